@@ -0,0 +1,300 @@
+#include "mesh.hpp"
+#include "rotation.hpp"
+#include "config.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <random>
+#include <string>
+
+using namespace std;
+
+// Times the stages of the deformation separately on the bundled meshes, from
+// the smallest to the largest, with fixed synthetic anchors, and reports the
+// accuracy of FastRotations against the JacobiSVD rotations (tests/rotations.cpp
+// checks it). Every stage is
+// reported with its median and 99th percentile time and its throughput in
+// vertices per second, optionally also as JSON to track regressions
+// Usage: ./arap_bench [-r ${Repeat}] [-j ${Json_path}] [${Obj_path} ...]
+//        a json path of - writes the JSON to stdout and the report to stderr
+
+const int WARMUP = 2;
+const int ITERATIONS = 10;      // iterations of the timed Deform calls
+int REPEAT = 20;
+
+struct StageTiming {
+    string name;
+    vector<double> milliseconds;    // one sample per repetition
+
+    double Percentile(double q) const {
+        vector<double> sorted = milliseconds;
+        sort(sorted.begin(), sorted.end());
+        int k = (int)ceil(q * sorted.size()) - 1;
+        return sorted[max(0, min(k, (int)sorted.size() - 1))];
+    }
+    double Median() const { return Percentile(0.5); }
+    double P99() const { return Percentile(0.99); }
+};
+
+struct MeshTiming {
+    string path;
+    int vertices = 0, faces = 0, anchors = 0;
+    vector<StageTiming> stages;
+
+    double Throughput(const StageTiming &stage) const {
+        double median = stage.Median();
+        return median > 0 ? vertices / (median / 1000) : 0;
+    }
+};
+
+// times run REPEAT times after WARMUP untimed runs, setup runs untimed before each of them
+StageTiming Measure(const string &name, const function<void()> &run, const function<void()> &setup = [] {}) {
+    StageTiming timing;
+    timing.name = name;
+    for (int i = 0; i < WARMUP + REPEAT; i++) {
+        setup();
+        auto start = chrono::steady_clock::now();
+        run();
+        auto end = chrono::steady_clock::now();
+        if (i >= WARMUP) timing.milliseconds.push_back(chrono::duration<double, milli>(end - start).count());
+    }
+    return timing;
+}
+
+// fixed synthetic constraints: every 50th vertex is kept in place,
+// the vertex in the middle is pulled away along x
+void SetSyntheticAnchors(Mesh &mesh) {
+    int n = (int)mesh.vList.size();
+    vector<int> anchors;
+    for (int i = 0; i < n; i += 50) anchors.push_back(i);
+    int moved = n / 2;
+    Vector3d extent = mesh.MaxCoord() - mesh.MinCoord();
+    mesh.vList[moved]->SetPosition(mesh.vList[moved]->Position() + Vector3d(0.1 * extent.X(), 0, 0));
+    anchors.push_back(moved);
+    mesh.SetConstraints(anchors);
+}
+
+// times every stage on the mesh of path, returns false if it cannot be loaded
+bool TimeMesh(const string &path, MeshTiming &result) {
+    result.path = path;
+
+    /* LoadObjFile including the half edge and adjacency construction, from the
+     * text and from a binary cache that is written for the benchmark. The cache
+     * goes next to a copy of the obj file in a temporary directory, so the
+     * benchmark never writes into the directory of the mesh */
+    string directory = (filesystem::temp_directory_path() / "arap_bench_XXXXXX").string();
+    if (!mkdtemp(&directory[0])) return false;
+    string copy = (filesystem::path(directory) / filesystem::path(path).filename()).string();
+    error_code error;
+    bool cached = filesystem::copy_file(path, copy, error);
+    if (cached) {
+        Mesh mesh;
+        mesh.read_mesh_cache = false;
+        mesh.write_mesh_cache = true;
+        cached = mesh.LoadObjFile(copy.c_str());
+    }
+    if (cached) {
+        result.stages.push_back(Measure("load_obj", [&] {
+            Mesh mesh;
+            mesh.read_mesh_cache = false;
+            mesh.LoadObjFile(copy.c_str());
+        }));
+        result.stages.push_back(Measure("load_cache", [&] {
+            Mesh mesh;
+            mesh.LoadObjFile(copy.c_str());
+        }));
+    }
+    filesystem::remove_all(directory, error);
+    if (!cached) return false;
+
+    Mesh mesh;
+    mesh.read_mesh_cache = false;
+    if (!mesh.LoadObjFile(path.c_str())) return false;
+    SetSyntheticAnchors(mesh);
+    result.vertices = (int)mesh.vList.size();
+    result.faces = (int)mesh.fList.size();
+    result.anchors = mesh.GetSignature(UNIFORM).anchor_indices.size();
+
+    /* the system stages one after another, as the first Deform call runs them */
+    result.stages.push_back(Measure("init_weights_uniform", [&] { mesh.InitWeights(UNIFORM); }));
+    result.stages.push_back(Measure("init_weights_cotangent", [&] { mesh.InitWeights(COTANGENT); }));
+    mesh.InitHandleMapping();
+    result.stages.push_back(Measure("build_linear_system", [&] { mesh.BuildLinearSystem(); }));
+
+    /* the local and global steps run on the state of a cotangent deformation */
+    mesh.signature.valid = false;
+    mesh.Deform(WARMUP, COTANGENT);
+    result.stages.push_back(Measure("estimate_rotations", [&] { mesh.EstimateRotations(); }));
+    mesh.rotation_solver = JACOBI_SVD;
+    result.stages.push_back(Measure("estimate_rotations_jacobi", [&] { mesh.EstimateRotations(); }));
+    mesh.rotation_solver = FAST_SVD;
+    Eigen::Matrix<double, 3, Eigen::Dynamic> previous = mesh.p_prime;
+    result.stages.push_back(Measure("solve_linear_system", [&] { mesh.SolveLinearSystem(); }));
+
+    /* conjugate gradients warm started from the positions the factorized solve started from */
+    mesh.linear_solver = CONJUGATE_GRADIENT;
+    result.stages.push_back(Measure("init_iterative_solver", [&] { mesh.FactorizeLinearSystem(); }));
+    result.stages.push_back(Measure("solve_linear_system_cg", [&] { mesh.SolveLinearSystem(); },
+                                    [&] { mesh.p_prime = previous; }));
+    mesh.linear_solver = LDLT;
+
+    /* a drag in the viewer reuses the factorization, a new constraint set rebuilds it */
+    result.stages.push_back(Measure("deform", [&] { mesh.Deform(ITERATIONS, COTANGENT); }));
+    result.stages.push_back(Measure("deform_rebuild", [&] { mesh.Deform(ITERATIONS, COTANGENT); },
+                                    [&] { mesh.signature.valid = false; }));
+    return true;
+}
+
+void PrintTiming(ostream &os, const MeshTiming &timing) {
+    os << timing.path << ": " << timing.vertices << " vertices, " << timing.faces << " faces, "
+       << timing.anchors << " anchors" << endl;
+    for (const StageTiming &stage: timing.stages) {
+        os << "  " << left << setw(26) << stage.name << right << fixed << setprecision(4)
+           << setw(11) << stage.Median() << " ms median" << setw(11) << stage.P99() << " ms p99"
+           << defaultfloat << setprecision(4) << setw(12) << timing.Throughput(stage) << " vertices/s" << endl;
+    }
+    os << setprecision(6);
+}
+
+string JsonString(const string &s) {
+    string quoted = "\"";
+    for (char c: s) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+void WriteJson(ostream &os, const vector<MeshTiming> &timings) {
+    os << setprecision(9);
+    os << "{\n  \"warmup\": " << WARMUP << ",\n  \"repeat\": " << REPEAT
+       << ",\n  \"iterations\": " << ITERATIONS << ",\n  \"threads\": " << Mesh().NumThreads()
+       << ",\n  \"rotation_lanes\": " << ROTATION_LANES << ",\n  \"meshes\": [";
+    for (size_t m = 0; m < timings.size(); m++) {
+        const MeshTiming &timing = timings[m];
+        os << (m ? "," : "") << "\n    {\"path\": " << JsonString(timing.path)
+           << ", \"vertices\": " << timing.vertices << ", \"faces\": " << timing.faces
+           << ", \"anchors\": " << timing.anchors << ", \"stages\": [";
+        for (size_t s = 0; s < timing.stages.size(); s++) {
+            const StageTiming &stage = timing.stages[s];
+            os << (s ? "," : "") << "\n      {\"name\": " << JsonString(stage.name)
+               << ", \"median_ms\": " << stage.Median() << ", \"p99_ms\": " << stage.P99()
+               << ", \"vertices_per_second\": " << timing.Throughput(stage) << ", \"samples_ms\": [";
+            for (size_t i = 0; i < stage.milliseconds.size(); i++) os << (i ? ", " : "") << stage.milliseconds[i];
+            os << "]}";
+        }
+        os << "\n    ]}";
+    }
+    os << "\n  ]\n}" << endl;
+}
+
+// fit the rotations of the given covariances with both solvers and report how far
+// FastRotations is off, on the objective tr(R S) and, for the random full rank
+// matrices, on R itself
+void ReportRotations(const vector<Eigen::Matrix3d> &covariances, const char *name, ostream &os) {
+    int n = (int)covariances.size();
+    vector<Eigen::Matrix3d> fast(n), reference(n);
+
+    auto start = chrono::steady_clock::now();
+    for (int g = 0; g < n; g += ROTATION_LANES) {
+        double S[3][3][ROTATION_LANES], R[3][3][ROTATION_LANES];
+        for (int l = 0; l < ROTATION_LANES; l++)
+            for (int r = 0; r < 3; r++)
+                for (int c = 0; c < 3; c++) S[r][c][l] = covariances[min(g + l, n - 1)](r, c);
+        FastRotations(S, R);
+        for (int l = 0; l < ROTATION_LANES && g + l < n; l++)
+            for (int r = 0; r < 3; r++)
+                for (int c = 0; c < 3; c++) fast[g + l](r, c) = R[r][c][l];
+    }
+    auto middle = chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) reference[i] = SvdRotation(covariances[i]);
+    auto end = chrono::steady_clock::now();
+
+    bool unique = string(name) == "random";
+    double deviation = 0, deficit = 0, determinant = 0;
+    for (int i = 0; i < n; i++) {
+        const Eigen::Matrix3d &S = covariances[i];
+        double scale = S.norm() + 1e-300;
+        if (unique) deviation = max(deviation, (fast[i] - reference[i]).norm());
+        deficit = max(deficit, ((reference[i] * S).trace() - (fast[i] * S).trace()) / scale);
+        determinant = max(determinant, abs(fast[i].determinant() - 1));
+    }
+    os << "  rotations (" << name << ", " << n << "): "
+         << chrono::duration<double, milli>(middle - start).count() << " ms fast, "
+         << chrono::duration<double, milli>(end - middle).count() << " ms JacobiSVD, deviation "
+         << deviation << ", objective deficit " << deficit << ", det error " << determinant << endl;
+}
+
+// random full rank matrices and near rotations, whose rotations are unique
+vector<Eigen::Matrix3d> RandomCovariances(int n) {
+    mt19937 generator(1);
+    normal_distribution<double> normal;
+    vector<Eigen::Matrix3d> covariances(n);
+    for (int i = 0; i < n; i++) {
+        Eigen::Matrix3d S;
+        for (int k = 0; k < 9; k++) S(k) = normal(generator);
+        if (i % 2) S = Eigen::Quaterniond::UnitRandom().toRotationMatrix() * (Eigen::Matrix3d::Identity() + 0.01 * S);
+        covariances[i] = S;
+    }
+    return covariances;
+}
+
+int main(int argc, char **argv) {
+    vector<string> paths;
+    string json_path;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) REPEAT = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) json_path = argv[++i];
+        else if (argv[i][0] == '-') {
+            cerr << "Usage: ./arap_bench [-r ${Repeat}] [-j ${Json_path}] [${Obj_path} ...]" << endl;
+            return 2;
+        }
+        else paths.push_back(argv[i]);
+    }
+    if (paths.empty()) {
+        for (auto &entry: filesystem::directory_iterator(string(PROJECT_DIR) + "data"))
+            if (entry.path().extension() == ".obj") paths.push_back(entry.path().string());
+        sort(paths.begin(), paths.end(), [](const string &a, const string &b) {
+            return filesystem::file_size(a) < filesystem::file_size(b);
+        });
+    }
+    ostream &report = json_path == "-" ? cerr : cout;
+
+    vector<MeshTiming> timings;
+    ReportRotations(RandomCovariances(100000), "random", report);
+    for (const string &path: paths) {
+        MeshTiming timing;
+        if (!TimeMesh(path, timing)) {
+            cerr << "Cannot load " << path << endl;
+            return 1;
+        }
+        PrintTiming(report, timing);
+        timings.push_back(timing);
+
+        Mesh mesh;
+        mesh.LoadObjFile(path.c_str());
+        SetSyntheticAnchors(mesh);
+        mesh.Deform(WARMUP, COTANGENT);
+        vector<Eigen::Matrix3d> covariances(mesh.vList.size());
+        for (int i = 0; i < covariances.size(); i++) covariances[i] = mesh.Covariance(i);
+        ReportRotations(covariances, "mesh", report);
+    }
+
+    if (json_path == "-") WriteJson(cout, timings);
+    else if (!json_path.empty()) {
+        ofstream ofs(json_path);
+        WriteJson(ofs, timings);
+        if (ofs.fail()) {
+            cerr << "Cannot write " << json_path << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include "mesh.hpp"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+// Batch deformation without a window: deforms a mesh with the anchors of an
+// anchor file and writes the result, or runs every job of a manifest, one job
+// per line in the same form as the command line, on all cores
+// Usage: ./arap_cli ${Obj_path} ${Anchors_path} ${Output_path} [options]
+//        ./arap_cli -m ${Manifest_path} [options]
+
+struct Job {
+    string mesh_path, anchor_path, output_path;
+    DeformOptions options;
+    WEIGHT_TYPE weight_type = UNIFORM;
+    CONSTRAINT_MODE constraint_mode = ELIMINATION;
+    double anchor_stiffness = 0;
+    LINEAR_SOLVER linear_solver = LDLT;
+    bool write_cache = false;
+};
+
+void PrintUsage() {
+    cout << "Usage: ./arap_cli ${Obj_path} ${Anchors_path} ${Output_path} [options]" << endl;
+    cout << "       ./arap_cli -m ${Manifest_path} [options]" << endl;
+    cout << "  -i N           at most N iterations (default 10)" << endl;
+    cout << "  -t TOLERANCE   stop once the relative energy decrease falls below TOLERANCE" << endl;
+    cout << "  -w TYPE        uniform or cotangent weights (default uniform)" << endl;
+    cout << "  -s SOLVER      ldlt, or cg for conjugate gradients without a factorization (default ldlt)" << endl;
+    cout << "  -f             factorize the Laplacian of all vertices once, anchors as constraints on it" << endl;
+    cout << "  -p W           like -f with soft anchors of penalty weight W" << endl;
+    cout << "  -c             write the binary cache next to the obj file" << endl;
+    cout << "  -j N           run N jobs of a manifest at the same time (default all cores)" << endl;
+    cout << "An output path ending in .obj is written as obj, anything else as binary." << endl;
+    cout << "Options given on the command line are the defaults of the manifest jobs." << endl;
+}
+
+// reads the options and positional arguments of args into job, returns false on a bad argument
+bool ParseArguments(const vector<string> &args, Job &job, vector<string> &positional, string *manifest, int *jobs) {
+    for (size_t i = 0; i < args.size(); i++) {
+        const string &arg = args[i];
+        bool has_value = i + 1 < args.size();
+        try {
+            if (arg == "-i" && has_value) job.options.max_iterations = stoi(args[++i]);
+            else if (arg == "-t" && has_value) job.options.tolerance = stod(args[++i]);
+            else if (arg == "-w" && has_value) {
+                string type = args[++i];
+                if (type == "uniform") job.weight_type = UNIFORM;
+                else if (type == "cotangent") job.weight_type = COTANGENT;
+                else return false;
+            }
+            else if (arg == "-s" && has_value) {
+                string solver = args[++i];
+                if (solver == "ldlt") job.linear_solver = LDLT;
+                else if (solver == "cg") job.linear_solver = CONJUGATE_GRADIENT;
+                else return false;
+            }
+            else if (arg == "-f") job.constraint_mode = FIXED_LAPLACIAN;
+            else if (arg == "-p" && has_value) {
+                job.constraint_mode = FIXED_LAPLACIAN;
+                job.anchor_stiffness = stod(args[++i]);
+                if (job.anchor_stiffness <= 0) return false;
+            }
+            else if (arg == "-c") job.write_cache = true;
+            else if (arg == "-m" && has_value && manifest) *manifest = args[++i];
+            else if (arg == "-j" && has_value && jobs) *jobs = stoi(args[++i]);
+            else if (arg.size() > 1 && arg[0] == '-') return false;
+            else positional.push_back(arg);
+        }
+        catch (const exception &) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// runs one job and reports it as one line, returns false if it failed
+bool RunJob(const Job &job, int num_threads, string &report) {
+    auto start = chrono::steady_clock::now();
+    Mesh mesh;
+    mesh.SetNumThreads(num_threads);
+    mesh.write_mesh_cache = job.write_cache;
+    mesh.constraint_mode = job.constraint_mode;
+    mesh.anchor_stiffness = job.anchor_stiffness;
+    mesh.linear_solver = job.linear_solver;
+    if (!mesh.LoadObjFile(job.mesh_path.c_str())) {
+        report = "Cannot load " + job.mesh_path;
+        return false;
+    }
+    if (!mesh.SetConstraints(job.anchor_path.c_str())) {
+        report = "Cannot read anchors " + job.anchor_path;
+        return false;
+    }
+
+    DeformStats stats = mesh.Deform(job.options, job.weight_type);
+
+    const string &out = job.output_path;
+    bool obj = out.size() >= 4 && out.compare(out.size() - 4, 4, ".obj") == 0;
+    if (!(obj ? mesh.SaveObjFile(out.c_str()) : mesh.SaveBinaryFile(out.c_str()))) {
+        report = "Cannot write " + out;
+        return false;
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    ostringstream oss;
+    oss << out << ": " << stats.iterations << " iterations, ";
+    if (!stats.energies.empty()) oss << "energy " << stats.energies.back() << (stats.converged ? " (converged)" : "") << ", ";
+    oss << seconds * 1000 << " ms";
+    report = oss.str();
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Job defaults;
+    vector<string> positional;
+    string manifest;
+    int jobs = 0;
+    if (!ParseArguments(vector<string>(argv + 1, argv + argc), defaults, positional, &manifest, &jobs)) {
+        PrintUsage();
+        return 2;
+    }
+
+    /* a single job uses all cores for its solver */
+    if (manifest.empty()) {
+        if (positional.size() != 3) {
+            PrintUsage();
+            return 2;
+        }
+        Job job = defaults;
+        job.mesh_path = positional[0];
+        job.anchor_path = positional[1];
+        job.output_path = positional[2];
+        string report;
+        bool ok = RunJob(job, 0, report);
+        (ok ? cout : cerr) << report << endl;
+        return ok ? 0 : 1;
+    }
+
+    /* manifest jobs run side by side, each on one core */
+    ifstream ifs(manifest);
+    if (ifs.fail()) {
+        cerr << "Cannot read manifest " << manifest << endl;
+        return 1;
+    }
+    vector<Job> job_list;
+    string line;
+    for (int number = 1; getline(ifs, line); number++) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#') continue;
+        istringstream iss(line);
+        vector<string> args;
+        string arg;
+        while (iss >> arg) args.push_back(arg);
+        Job job = defaults;
+        vector<string> paths;
+        if (!ParseArguments(args, job, paths, NULL, NULL) || paths.size() != 3) {
+            cerr << manifest << ":" << number << ": bad job" << endl;
+            return 2;
+        }
+        job.mesh_path = paths[0];
+        job.anchor_path = paths[1];
+        job.output_path = paths[2];
+        job_list.push_back(job);
+    }
+
+#ifdef _OPENMP
+    if (jobs <= 0) jobs = omp_get_max_threads();
+#endif
+    int failed = 0;
+    #pragma omp parallel for schedule(dynamic) num_threads(jobs > 0 ? jobs : 1) reduction(+:failed)
+    for (int i = 0; i < (int)job_list.size(); i++) {
+        string report;
+        bool ok = RunJob(job_list[i], 1, report);
+        failed += !ok;
+        #pragma omp critical
+        (ok ? cout : cerr) << report << endl;
+    }
+    cout << job_list.size() - failed << " of " << job_list.size() << " jobs done" << endl;
+    return failed ? 1 : 0;
+}
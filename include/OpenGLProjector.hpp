@@ -15,7 +15,7 @@ private:
     double projection[16];
     int viewport[4];
 
-    float* depthBuffer;
+    float* depthBuffer;     // read back on the first GetDepthValue call
 
 public:
     double* ModelViewMatrix() { return modelView; }
@@ -27,12 +27,11 @@ public:
         glGetDoublev(GL_MODELVIEW_MATRIX, modelView);
         glGetDoublev(GL_PROJECTION_MATRIX, projection);
         glGetIntegerv(GL_VIEWPORT, viewport);
-
-        depthBuffer = new float[viewport[2] * viewport[3]];
-
-        glReadPixels(viewport[0], viewport[1], viewport[2], viewport[3], GL_DEPTH_COMPONENT, GL_FLOAT, depthBuffer);
-
+        depthBuffer = NULL;
     }
+    ~OpenGLProjector() { delete[] depthBuffer; }
+    OpenGLProjector(const OpenGLProjector &) = delete;
+    OpenGLProjector & operator=(const OpenGLProjector &) = delete;
     Vector3d UnProject(double inX, double inY, double inZ)
     {
         double x,y,z;
@@ -59,6 +58,11 @@ public:
     }
     double GetDepthValue(int x, int y)
     {
+        if (depthBuffer == NULL)
+        {
+            depthBuffer = new float[viewport[2] * viewport[3]];
+            glReadPixels(viewport[0], viewport[1], viewport[2], viewport[3], GL_DEPTH_COMPONENT, GL_FLOAT, depthBuffer);
+        }
         return depthBuffer[(y-viewport[1])*viewport[2] + (x-viewport[0])];
     }
 };
@@ -0,0 +1,198 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "mesh.hpp"
+
+////////// struct RayHit //////////
+// nearest intersection of a ray with the mesh, face -1 if the ray missed it
+struct RayHit {
+    int face = -1;
+    double t = std::numeric_limits<double>::infinity();    // hit point is origin + t * direction
+    double u = 0, v = 0;                                    // barycentric weights of corners 1 and 2
+};
+
+////////// class TriangleBVH //////////
+// bounding volume hierarchy over the faces of a mesh at the positions of p_prime.
+// the tree is built when the mesh is (re)loaded. after a deformation only its
+// boxes are refitted to the new positions, the topology of the tree stays
+class TriangleBVH {
+private:
+    // depth first order, the left child of an inner node follows it directly
+    struct Node {
+        Eigen::Vector3d lower, upper;
+        int right;      // inner node: index of the right child
+        int first;      // leaf: first face in order, -1 for inner nodes
+        int count;      // leaf: number of faces
+    };
+    static const int LEAF_SIZE = 4;
+
+    std::vector<Node> nodes;
+    std::vector<int> order;             // faces sorted by leaves
+    const Mesh *source = NULL;
+    size_t topology_version = 0;
+    size_t vertex_version = 0;
+
+    void FaceBounds(const Mesh & mesh, int f, Eigen::Vector3d & lower, Eigen::Vector3d & upper) const {
+        lower = upper = mesh.p_prime.col(mesh.faces(0, f));
+        for (int k = 1; k < 3; k++) {
+            lower = lower.cwiseMin(mesh.p_prime.col(mesh.faces(k, f)));
+            upper = upper.cwiseMax(mesh.p_prime.col(mesh.faces(k, f)));
+        }
+    }
+
+    /* split at the median centroid along the longest axis of the centroid bounds */
+    int BuildNode(const std::vector<Eigen::Vector3d> & centroids, int begin, int end) {
+        int index = (int)nodes.size();
+        nodes.push_back(Node());
+        if (end - begin <= LEAF_SIZE) {
+            nodes[index].first = begin;
+            nodes[index].count = end - begin;
+            return index;
+        }
+        Eigen::Vector3d lower = centroids[order[begin]], upper = lower;
+        for (int k = begin + 1; k < end; k++) {
+            lower = lower.cwiseMin(centroids[order[k]]);
+            upper = upper.cwiseMax(centroids[order[k]]);
+        }
+        int axis;
+        (upper - lower).maxCoeff(&axis);
+        int middle = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end,
+                         [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+        nodes[index].first = -1;
+        nodes[index].count = 0;
+        BuildNode(centroids, begin, middle);
+        int right = BuildNode(centroids, middle, end);
+        nodes[index].right = right;
+        return index;
+    }
+
+    /* children come after their parent, so one backward sweep refits every box */
+    void Refit(const Mesh & mesh) {
+        for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+            Node &node = nodes[i];
+            if (node.first >= 0) {
+                FaceBounds(mesh, order[node.first], node.lower, node.upper);
+                for (int k = 1; k < node.count; k++) {
+                    Eigen::Vector3d lower, upper;
+                    FaceBounds(mesh, order[node.first + k], lower, upper);
+                    node.lower = node.lower.cwiseMin(lower);
+                    node.upper = node.upper.cwiseMax(upper);
+                }
+            }
+            else {
+                const Node &left = nodes[i + 1], &right = nodes[node.right];
+                node.lower = left.lower.cwiseMin(right.lower);
+                node.upper = left.upper.cwiseMax(right.upper);
+            }
+        }
+    }
+
+    /* entry distance of the ray into the box, infinity if it misses it before t_max */
+    static double EnterBox(const Node & node, const Eigen::Vector3d & origin, const Eigen::Vector3d & inverse, double t_max) {
+        double t_near = 0, t_far = t_max;
+        for (int a = 0; a < 3; a++) {
+            double t0 = (node.lower[a] - origin[a]) * inverse[a];
+            double t1 = (node.upper[a] - origin[a]) * inverse[a];
+            if (t0 > t1) std::swap(t0, t1);
+            t_near = std::max(t_near, t0);
+            t_far = std::min(t_far, t1);
+            if (t_near > t_far) return std::numeric_limits<double>::infinity();
+        }
+        return t_near;
+    }
+
+    /* Moller-Trumbore, both sides of the triangle count */
+    static bool IntersectFace(const Mesh & mesh, int f, const Eigen::Vector3d & origin, const Eigen::Vector3d & direction, RayHit & hit) {
+        Eigen::Vector3d p0 = mesh.p_prime.col(mesh.faces(0, f));
+        Eigen::Vector3d e1 = mesh.p_prime.col(mesh.faces(1, f)) - p0;
+        Eigen::Vector3d e2 = mesh.p_prime.col(mesh.faces(2, f)) - p0;
+        Eigen::Vector3d p = direction.cross(e2);
+        double determinant = e1.dot(p);
+        if (std::abs(determinant) < 1e-300) return false;
+        double inverse = 1.0 / determinant;
+        Eigen::Vector3d s = origin - p0;
+        double u = s.dot(p) * inverse;
+        if (u < 0 || u > 1) return false;
+        Eigen::Vector3d q = s.cross(e1);
+        double v = direction.dot(q) * inverse;
+        if (v < 0 || u + v > 1) return false;
+        double t = e2.dot(q) * inverse;
+        if (t < 0 || t >= hit.t) return false;
+        hit.face = f;
+        hit.t = t;
+        hit.u = u;
+        hit.v = v;
+        return true;
+    }
+
+public:
+    // rebuilds the tree if the mesh was reloaded, refits it if the mesh was deformed
+    void Update(const Mesh & mesh) {
+        if (&mesh != source || mesh.topology_version != topology_version) {
+            source = &mesh;
+            topology_version = mesh.topology_version;
+            vertex_version = mesh.vertex_version;
+            int m = (int)mesh.faces.cols();
+            std::vector<Eigen::Vector3d> centroids(m);
+            for (int f = 0; f < m; f++) {
+                centroids[f] = (mesh.p_prime.col(mesh.faces(0, f)) + mesh.p_prime.col(mesh.faces(1, f))
+                                + mesh.p_prime.col(mesh.faces(2, f))) / 3;
+            }
+            order.resize(m);
+            for (int f = 0; f < m; f++) order[f] = f;
+            nodes.clear();
+            if (m > 0) BuildNode(centroids, 0, m);
+            Refit(mesh);
+        }
+        else if (mesh.vertex_version != vertex_version) {
+            vertex_version = mesh.vertex_version;
+            Refit(mesh);
+        }
+    }
+
+    // nearest face hit by the ray, call Update first
+    RayHit Raycast(const Mesh & mesh, const Eigen::Vector3d & origin, const Eigen::Vector3d & direction) const {
+        RayHit hit;
+        if (nodes.empty()) return hit;
+        Eigen::Vector3d inverse = direction.cwiseInverse();
+        std::vector<int> stack;
+        stack.push_back(0);
+        while (!stack.empty()) {
+            const Node &node = nodes[stack.back()];
+            stack.pop_back();
+            if (EnterBox(node, origin, inverse, hit.t) == std::numeric_limits<double>::infinity()) continue;
+            if (node.first >= 0) {
+                for (int k = 0; k < node.count; k++) IntersectFace(mesh, order[node.first + k], origin, direction, hit);
+                continue;
+            }
+            /* the nearer child is popped first */
+            int left = (int)(&node - nodes.data()) + 1, right = node.right;
+            double t_left = EnterBox(nodes[left], origin, inverse, hit.t);
+            double t_right = EnterBox(nodes[right], origin, inverse, hit.t);
+            if (t_left < t_right) std::swap(left, right);
+            stack.push_back(left);
+            stack.push_back(right);
+        }
+        return hit;
+    }
+
+    // the corner of the nearest hit face closest to the hit point, -1 if the ray missed the mesh
+    int PickVertex(const Mesh & mesh, const Eigen::Vector3d & origin, const Eigen::Vector3d & direction) const {
+        RayHit hit = Raycast(mesh, origin, direction);
+        if (hit.face < 0) return -1;
+        Eigen::Vector3d point = origin + hit.t * direction;
+        int nearest = mesh.faces(0, hit.face);
+        for (int k = 1; k < 3; k++) {
+            int i = mesh.faces(k, hit.face);
+            if ((mesh.p_prime.col(i) - point).squaredNorm() < (mesh.p_prime.col(nearest) - point).squaredNorm()) nearest = i;
+        }
+        return nearest;
+    }
+};
+
+#endif // __BVH_H__
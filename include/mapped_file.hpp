@@ -0,0 +1,46 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+////////// class MappedFile //////////
+// read-only memory mapping of a whole file, unmapped when it goes out of scope
+class MappedFile {
+private:
+    const char *data;
+    size_t size;
+    bool open;
+public:
+    MappedFile(const char *filename) : data(NULL), size(0), open(false) {
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            size = (size_t)st.st_size;
+            if (size == 0) open = true;     // mmap refuses empty files
+            else {
+                void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    data = (const char *)mapped;
+                    open = true;
+                    madvise(mapped, size, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        ::close(fd);
+    }
+    ~MappedFile() { if (data) munmap((void *)data, size); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    const char * Data() const { return data; }
+    const char * End() const { return data + size; }
+    size_t Size() const { return size; }
+    bool IsOpen() const { return open; }
+};
+
+#endif // __MAPPED_FILE_H__
@@ -2,9 +2,19 @@
 #define __MATRIX_H__
 
 #include <cstdlib>
+#include <cmath>
+#include <ostream>
 #include <vector>
 #include <assert.h>
 #include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// preconditioners of Matrix::PCG
+enum PRECONDITIONER{
+    NO_PRECONDITIONER, JACOBI, INCOMPLETE_CHOLESKY
+};
 
 ///////////////////////////////////////
 // struct MatrixElement
@@ -31,49 +41,173 @@ struct MatrixElement
 typedef std::vector<MatrixElement> MatrixElementList;
 
 // class Matrix definition
+// sparse matrix in compressed rows. PCG solves a symmetric positive definite
+// system with it without factorizing, so next to the nonzeros it only keeps
+// the preconditioner and four work vectors per right hand side
 class Matrix
 {
 private:
+    static const int MAX_COLUMNS = 4;	// right hand sides PCG solves at once
+    static const int BLOCK = 4096;		// rows per partial sum of a dot product
+
     int m, n;	// size of matrix (m = # of rows, n # of columns)
-    MatrixElementList elements;	// list of non-zero entries
-    int * rowIndex;				// row indice of non-zero entries
-
-    // fields for CG method
-    double* diagInv;
-    double* r;
-    double* r2;
-    double* d;
-    double* d2;
-    double* q;
-    double* s;
-    double* s2;
+    MatrixElementList elements;	// entries added since the last SortMatrix
+    std::vector<int> rowIndex;	// entries of row i are rowIndex[i] ... rowIndex[i+1]-1
+    std::vector<int> colIndex;	// column of each entry, increasing within a row
+    std::vector<double> values;	// value of each entry
+    int threads;				// threads of Multiply and PCG, 0 for all cores
+
+    // fields for the preconditioner
+    PRECONDITIONER preconditioner;
+    std::vector<double> diagInv;			// JACOBI: inverse of the diagonal
+    std::vector<int> lowerIndex, lowerCol;	// INCOMPLETE_CHOLESKY: lower triangle of the
+    std::vector<double> lower;				// factor in compressed rows, diagonal last
+
+    // fields for CG method, m * columns each
+    std::vector<double> r;
+    std::vector<double> z;
+    std::vector<double> d;
+    std::vector<double> q;
+    std::vector<double> partial;
+    int iterations;
+    double residual;
+
+    int Threads() const
+    {
+#ifdef _OPENMP
+        return threads > 0 ? threads : omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
 
-public:
-    // constructor & destructor
-    Matrix(int m, int n) : m(m), n(n)
+    /////////////////////////////////////
+    // function Dot
+    // result[c] = sum_i a[i][c] * b[i][c], summed over fixed blocks of rows
+    // so the result does not depend on the number of threads
+    void Dot(const double* a, const double* b, int columns, double* result)
     {
-        rowIndex = new int[m+1];
-        diagInv = new double[m];
-        r = new double[m];
-        r2 = new double[m];
-        d = new double[m];
-        d2 = new double[m];
-        q = new double[m];
-        s = new double[m];
-        s2 = new double[m];
+        int blocks = (m + BLOCK - 1) / BLOCK;
+        partial.assign((size_t)blocks * columns, 0);
+        #pragma omp parallel for schedule(static) num_threads(Threads())
+        for (int block = 0; block < blocks; block++)
+        {
+            double *sum = &partial[(size_t)block * columns];
+            int end = std::min(m, (block + 1) * BLOCK);
+            for (int i = block * BLOCK; i < end; i++)
+                for (int c = 0; c < columns; c++)
+                    sum[c] += a[(size_t)i * columns + c] * b[(size_t)i * columns + c];
+        }
+        for (int c = 0; c < columns; c++)
+        {
+            result[c] = 0;
+            for (int block = 0; block < blocks; block++)
+                result[c] += partial[(size_t)block * columns + c];
+        }
     }
-    ~Matrix()
+
+    /////////////////////////////////////
+    // function Precondition
+    // compute zOut = M^-1 * rIn for every column
+    void Precondition(const double* rIn, double* zOut, int columns)
     {
-        delete[] rowIndex;
-        delete[] r;
-        delete[] r2;
-        delete[] d;
-        delete[] d2;
-        delete[] q;
-        delete[] s;
-        delete[] s2;
+        size_t size = (size_t)m * columns;
+        if (preconditioner == JACOBI)
+        {
+            #pragma omp parallel for schedule(static) num_threads(Threads())
+            for (int i = 0; i < m; i++)
+                for (int c = 0; c < columns; c++)
+                    zOut[(size_t)i * columns + c] = diagInv[i] * rIn[(size_t)i * columns + c];
+        }
+        else if (preconditioner == INCOMPLETE_CHOLESKY)
+        {
+            /* G y = r, row oriented */
+            for (int i = 0; i < m; i++)
+            {
+                int diagonal = lowerIndex[i+1] - 1;
+                for (int c = 0; c < columns; c++)
+                {
+                    double sum = rIn[(size_t)i * columns + c];
+                    for (int k = lowerIndex[i]; k < diagonal; k++)
+                        sum -= lower[k] * zOut[(size_t)lowerCol[k] * columns + c];
+                    zOut[(size_t)i * columns + c] = sum / lower[diagonal];
+                }
+            }
+            /* G^T z = y, column oriented on the rows of G */
+            for (int i = m - 1; i >= 0; i--)
+            {
+                int diagonal = lowerIndex[i+1] - 1;
+                for (int c = 0; c < columns; c++)
+                {
+                    double zi = zOut[(size_t)i * columns + c] / lower[diagonal];
+                    zOut[(size_t)i * columns + c] = zi;
+                    for (int k = lowerIndex[i]; k < diagonal; k++)
+                        zOut[(size_t)lowerCol[k] * columns + c] -= lower[k] * zi;
+                }
+            }
+        }
+        else
+        {
+            std::copy(rIn, rIn + size, zOut);
+        }
     }
 
+    /////////////////////////////////////
+    // function Factorize
+    // incomplete Cholesky G G^T of the lower triangle without fill-in,
+    // returns false if a pivot is not positive
+    bool Factorize()
+    {
+        lowerIndex.assign(m + 1, 0);
+        lowerCol.clear();
+        lower.clear();
+        for (int i = 0; i < m; i++)
+        {
+            for (int k = rowIndex[i]; k < rowIndex[i+1] && colIndex[k] <= i; k++)
+            {
+                lowerCol.push_back(colIndex[k]);
+                lower.push_back(values[k]);
+            }
+            lowerIndex[i+1] = (int)lowerCol.size();
+            if (lowerCol.empty() || lowerCol.back() != i) return false;
+        }
+
+        for (int i = 0; i < m; i++)
+        {
+            for (int k = lowerIndex[i]; k < lowerIndex[i+1]; k++)
+            {
+                /* subtract the columns rows i and j share left of column j */
+                int j = lowerCol[k];
+                double sum = lower[k];
+                int p = lowerIndex[i], pj = lowerIndex[j], jDiagonal = lowerIndex[j+1] - 1;
+                while (p < k && pj < jDiagonal)
+                {
+                    if (lowerCol[p] < lowerCol[pj]) p++;
+                    else if (lowerCol[p] > lowerCol[pj]) pj++;
+                    else sum -= lower[p++] * lower[pj++];
+                }
+                if (j < i) lower[k] = sum / lower[jDiagonal];
+                else if (sum > 0) lower[k] = std::sqrt(sum);
+                else return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    // constructor
+    Matrix(int m = 0, int n = 0)
+        : m(m), n(n), rowIndex(m + 1, 0), threads(0), preconditioner(NO_PRECONDITIONER), iterations(0), residual(0) {}
+
+    int Rows() const { return m; }
+    int Cols() const { return n; }
+    size_t NonZeros() const { return values.size(); }
+    void SetNumThreads(int t) { threads = t; }
+    PRECONDITIONER Preconditioner() const { return preconditioner; }
+    // iterations and relative residual |b - Ax| / |b| of the worst column of the last PCG call
+    int Iterations() const { return iterations; }
+    double Residual() const { return residual; }
+
     /////////////////////////////////////
     // function AddElement
     // add a new entry into the matrix
@@ -84,37 +218,95 @@ public:
 
     /////////////////////////////////////
     // function SortMatrix
-    // sort the matrix elements after you add ALL elements into the matrix
+    // sort the matrix elements after you add ALL elements into the matrix,
+    // entries at the same position are summed
     void SortMatrix()
     {
-        sort(elements.begin( ), elements.end( ), MatrixElement::order);
+        std::sort(elements.begin( ), elements.end( ), MatrixElement::order);
 
-        for (int i=0; i<m+1; i++)
-            rowIndex[i] = 0;
+        rowIndex.assign(m + 1, 0);
+        colIndex.clear();
+        values.clear();
         for (int i=0; i<(int)elements.size(); i++)
-            rowIndex[elements[i].row + 1] = i + 1;
-
+        {
+            const MatrixElement &e = elements[i];
+            if (i > 0 && e.row == elements[i-1].row && e.col == elements[i-1].col)
+                values.back() += e.value;
+            else
+            {
+                colIndex.push_back(e.col);
+                values.push_back(e.value);
+                rowIndex[e.row + 1]++;
+            }
+        }
         for (int i=0; i<m; i++)
-            diagInv[i] = 0;
-        for (int i=0; i<(int)elements.size(); i++)
-            if (elements[i].row == elements[i].col)
-                diagInv[elements[i].row] = 1.0 / elements[i].value;
+            rowIndex[i+1] += rowIndex[i];
+        MatrixElementList().swap(elements);
+        preconditioner = NO_PRECONDITIONER;
+    }
+
+    /////////////////////////////////////
+    // function Assign
+    // copy a matrix given in compressed rows. a symmetric matrix can also be
+    // passed in compressed columns, e.g. the arrays of an Eigen::SparseMatrix
+    void Assign(int rows, int cols, const int* outer, const int* inner, const double* vals)
+    {
+        m = rows;
+        n = cols;
+        rowIndex.assign(outer, outer + m + 1);
+        colIndex.assign(inner, inner + outer[m]);
+        values.assign(vals, vals + outer[m]);
+        MatrixElementList().swap(elements);
+        preconditioner = NO_PRECONDITIONER;
     }
 
+    /////////////////////////////////////
+    // function SetPreconditioner
+    // set up the preconditioner of PCG for the current values of the matrix.
+    // falls back to JACOBI and returns false if the incomplete Cholesky
+    // factorization breaks down
+    bool SetPreconditioner(PRECONDITIONER type)
+    {
+        assert(m == n);
+        std::vector<int>().swap(lowerIndex);
+        std::vector<int>().swap(lowerCol);
+        std::vector<double>().swap(lower);
+        preconditioner = type;
+        if (type == INCOMPLETE_CHOLESKY)
+        {
+            if (Factorize()) return true;
+            std::vector<int>().swap(lowerIndex);
+            std::vector<int>().swap(lowerCol);
+            std::vector<double>().swap(lower);
+            preconditioner = JACOBI;
+        }
+        if (preconditioner == JACOBI)
+        {
+            diagInv.assign(m, 1);
+            for (int i=0; i<m; i++)
+                for (int k=rowIndex[i]; k<rowIndex[i+1]; k++)
+                    if (colIndex[k] == i && values[k] != 0)
+                        diagInv[i] = 1.0 / values[k];
+        }
+        return preconditioner == type;
+    }
 
     /////////////////////////////////////
     // function Multiply
-    // compute A * xIn = xOut
+    // compute A * xIn = xOut for `columns` vectors stored row by row
     // the arrays pointed by xIn and xOut have to be pre-allocated
     // and have enough space
-    void Multiply(double* xIn, double* xOut)
+    void Multiply(const double* xIn, double* xOut, int columns = 1)
     {
+        #pragma omp parallel for schedule(static) num_threads(Threads())
         for (int i=0; i<m; i++)
         {
-            double sum = 0;
+            double sum[MAX_COLUMNS] = {};
             for (int j=rowIndex[i]; j<rowIndex[i+1]; j++)
-                sum += elements[j].value * xIn[elements[j].col];
-            xOut[i] = sum;
+                for (int c=0; c<columns; c++)
+                    sum[c] += values[j] * xIn[(size_t)colIndex[j] * columns + c];
+            for (int c=0; c<columns; c++)
+                xOut[(size_t)i * columns + c] = sum[c];
         }
     }
     /////////////////////////////////////
@@ -122,110 +314,128 @@ public:
     // compute xIn * A = xOut
     // the arrays pointed by xIn and xOut have to be pre-allocated
     // and have enough space
-    void PreMultiply(double* xIn, double* xOut)
+    void PreMultiply(const double* xIn, double* xOut)
     {
         for (int i=0; i<n; i++) xOut[i] = 0;
 
         for (int i=0; i<m; i++)
         {
             for (int j=rowIndex[i]; j<rowIndex[i+1]; j++)
-                xOut[elements[j].col] += elements[j].value * xIn[i];
+                xOut[colIndex[j]] += values[j] * xIn[i];
         }
     }
 
     /**********************************************/
-    /* function: BCG                              */
+    /* function: PCG                              */
     /* description: solve Ax = b for unknowns x   */
     /**********************************************/
-    void BCG(double* b, double* x)
+    // preconditioned conjugate gradients for up to MAX_COLUMNS right hand sides
+    // stored row by row, b[i * columns + c]. x holds the initial guess, e.g. the
+    // previous solution. every column stops once |b - Ax| <= tolerance * |b|,
+    // returns the number of iterations
+    int PCG(const double* b, double* x, int columns, double tolerance, int max_iterations)
     {
-        assert(m == n);
-
-        auto mse = [=](double *vec1, double *vec2){
-            double sum = 0;
-            for(int i = 0; i < m; i++){
-                sum += (vec1[i] - vec2[i]) * (vec1[i] - vec2[i]);
-            }
-            return 1.0 * sum / m;
-        };
-
-        /* Initialization */
-        for(int i = 0; i < m; i++){
-            x[i] = b[i];
-        }
-
-        /* d = r = b - Ax */
-        double Ax[m];
-        this->Multiply(x, Ax);
-        for(int i = 0; i < m; i++){
-            r[i] = b[i] - Ax[i];
-            d[i] = r[i];
+        assert(m == n && columns >= 1 && columns <= MAX_COLUMNS);
+        size_t size = (size_t)m * columns;
+        r.resize(size);
+        z.resize(size);
+        d.resize(size);
+        q.resize(size);
+
+        /* r = b - Ax, d = z = M^-1 r */
+        this->Multiply(x, q.data(), columns);
+        #pragma omp parallel for schedule(static) num_threads(Threads())
+        for (int i = 0; i < m; i++)
+            for (int c = 0; c < columns; c++)
+                r[(size_t)i * columns + c] = b[(size_t)i * columns + c] - q[(size_t)i * columns + c];
+        this->Precondition(r.data(), z.data(), columns);
+        std::copy(z.begin(), z.end(), d.begin());
+
+        double bb[MAX_COLUMNS], rr[MAX_COLUMNS], rz[MAX_COLUMNS], dq[MAX_COLUMNS], rzNext[MAX_COLUMNS];
+        double alpha[MAX_COLUMNS], beta[MAX_COLUMNS];
+        bool active[MAX_COLUMNS];
+        this->Dot(b, b, columns, bb);
+        this->Dot(r.data(), r.data(), columns, rr);
+        this->Dot(r.data(), z.data(), columns, rz);
+        int remaining = 0;
+        for (int c = 0; c < columns; c++)
+        {
+            active[c] = rr[c] > tolerance * tolerance * bb[c];
+            remaining += active[c];
         }
 
-        for(int iter = 0; iter < 100; iter++){
-            /* a(i) = r(i)^T * r(i) / (d(i)^T * A * d(i)) */
-            double Ad[m];
-            this->Multiply(d, Ad);
-            double numerator = 0, denominator = 0;
-            for(int i = 0; i < m; i++){
-                numerator += r[i] * r[i];
-                denominator += d[i] * Ad[i];
-            }
-            double alpha = 1.0 * numerator / denominator;
-
-            /* x(i+1) = x(i) + a(i)*d(i) */
-            for(int i = 0; i < m; i++){
-                x[i] += alpha * d[i];
-            }
-
-            /* r(i+1) = r(i) - a(i)*A*d(i) */
-            for(int i = 0; i < m; i++){
-                r2[i] = r[i] - alpha * Ad[i];
-            }
-
-            /* beta(i+1) = r(i+1)^T * r(i+1) / (r(i)^T * r(i)) */
-            numerator = 0;
-            denominator = 0;
-            for(int i = 0; i < m; i++){
-                numerator += r2[i] * r2[i];
-                denominator += r[i] * r[i];
-            }
-            double beta = 1.0 * numerator / denominator;
-
-            /* d(i+1) = r(i+1) + beta(i+1) * d(i) */
-            for(int i = 0; i < m; i++){
-                d2[i] = r2[i] + beta * d[i];
+        int iter = 0;
+        for (; iter < max_iterations && remaining > 0; iter++)
+        {
+            /* a(i) = r(i)^T * z(i) / (d(i)^T * A * d(i)), converged columns stay */
+            this->Multiply(d.data(), q.data(), columns);
+            this->Dot(d.data(), q.data(), columns, dq);
+            for (int c = 0; c < columns; c++)
+                alpha[c] = active[c] && dq[c] > 0 ? rz[c] / dq[c] : 0;
+
+            /* x(i+1) = x(i) + a(i)*d(i), r(i+1) = r(i) - a(i)*A*d(i) */
+            #pragma omp parallel for schedule(static) num_threads(Threads())
+            for (int i = 0; i < m; i++)
+            {
+                for (int c = 0; c < columns; c++)
+                {
+                    size_t k = (size_t)i * columns + c;
+                    x[k] += alpha[c] * d[k];
+                    r[k] -= alpha[c] * q[k];
+                }
             }
 
-            if(mse(d, d2) < 1e-10){
-                break;
+            /* beta(i+1) = r(i+1)^T * z(i+1) / (r(i)^T * z(i)) */
+            this->Precondition(r.data(), z.data(), columns);
+            this->Dot(r.data(), r.data(), columns, rr);
+            this->Dot(r.data(), z.data(), columns, rzNext);
+            for (int c = 0; c < columns; c++)
+            {
+                beta[c] = active[c] && rz[c] != 0 ? rzNext[c] / rz[c] : 0;
+                rz[c] = rzNext[c];
+                if (active[c] && rr[c] <= tolerance * tolerance * bb[c])
+                {
+                    active[c] = false;
+                    remaining--;
+                }
             }
 
-            for(int i = 0; i < m; i++){
-                r[i] = r2[i];
-                d[i] = d2[i];
+            /* d(i+1) = z(i+1) + beta(i+1) * d(i) */
+            #pragma omp parallel for schedule(static) num_threads(Threads())
+            for (int i = 0; i < m; i++)
+            {
+                for (int c = 0; c < columns; c++)
+                {
+                    size_t k = (size_t)i * columns + c;
+                    d[k] = z[k] + beta[c] * d[k];
+                }
             }
-
         }
+
+        iterations = iter;
+        residual = 0;
+        for (int c = 0; c < columns; c++)
+            residual = std::max(residual, bb[c] > 0 ? std::sqrt(rr[c] / bb[c]) : std::sqrt(rr[c]));
+        return iter;
     }
 
     // friend operators
-    friend ostream & operator<< (ostream & out, const Matrix & r)
+    friend std::ostream & operator<< (std::ostream & out, const Matrix & r)
     {
         for (int i=0; i<r.m; i++)
         {
             for(int j=r.rowIndex[i]; j<r.rowIndex[i+1]; j++)
-                out << r.elements[j].value << " ";
-            out << endl;
+                out << r.values[j] << " ";
+            out << std::endl;
         }
 
         return out;
     }
 
     double at(int x, int y){
-        return elements[rowIndex[y]+x].value;
+        return values[rowIndex[y]+x];
     }
 
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,14 +1,18 @@
 #ifndef __MESH_H__
 #define __MESH_H__
 
+#include <algorithm>
 #include <cstdlib>
 #include <vector>
 #include "vector3.hpp"
+#include "profile.hpp"
+#include "matrix.hpp"
 #include <Eigen/Core>
 #include <Eigen/SVD>
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
 #include <unordered_map>
+#include <type_traits>
 
 // classes
 class HEdge;
@@ -18,12 +22,37 @@ class Mesh;
 class OneRingHEdge;
 class OneRingVertex;
 class FaceEnumeration;
+class MappedFile;
 
 // types
 typedef std::vector<HEdge*> HEdgeList;
 typedef std::vector<Vertex*> VertexList;
 typedef std::vector<Face*> FaceList;
 typedef Eigen::Matrix<double, 3, 1> Point;
+typedef Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor> PointRows;   // one point per row
+
+////////// class ElementSpan //////////
+// read-only view of an element list of the mesh, std::span is C++20.
+// valid until the mesh is reloaded, indexing and iterating copy nothing
+template <class T>
+class ElementSpan {
+private:
+    T * const *first;
+    size_t count;
+public:
+    ElementSpan(const std::vector<T*> & list) : first(list.data()), count(list.size()) { }
+
+    T * operator[] (size_t i) const { return first[i]; }
+    T * const * begin() const { return first; }
+    T * const * end() const { return first + count; }
+    T * front() const { return first[0]; }
+    T * back() const { return first[count - 1]; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+};
+typedef ElementSpan<HEdge> HEdgeSpan;
+typedef ElementSpan<Vertex> VertexSpan;
+typedef ElementSpan<Face> FaceSpan;
 
 // enums
 enum WEIGHT_TYPE{
@@ -32,57 +61,224 @@ enum WEIGHT_TYPE{
 enum VERTEX_TYPE{
     HANDLE, ANCHOR, STATIONARY
 };
+enum ROTATION_SOLVER{
+    JACOBI_SVD, FAST_SVD
+};
+// ELIMINATION drops the anchors from the unknowns of L. FIXED_LAPLACIAN drops one
+// ground vertex per connected component, which keeps L definite, and factorizes it
+// once: hard and soft anchors of any number are constrained through the border of a
+// ConstraintUpdate, which costs a solve and memory for one column of L^-1 per anchor
+enum CONSTRAINT_MODE{
+    ELIMINATION, FIXED_LAPLACIAN
+};
+// LDLT factorizes L once per constraint topology, CONJUGATE_GRADIENT never
+// factorizes it and only needs memory linear in its nonzeros
+enum LINEAR_SOLVER{
+    LDLT, CONJUGATE_GRADIENT
+};
+
+////////// struct ConstraintSignature //////////
+// topology of the constraint set: which vertices are anchors and which
+// weights are used. as long as it stays the same, L and its factorization
+// can be reused and only the anchor positions in b_init have to be updated
+struct ConstraintSignature {
+    std::vector<int> anchor_indices;    // sorted anchor indices, the eliminated vertices for a built L
+    WEIGHT_TYPE weight_type = UNIFORM;
+    CONSTRAINT_MODE constraint_mode = ELIMINATION;
+    LINEAR_SOLVER linear_solver = LDLT;
+    PRECONDITIONER preconditioner = NO_PRECONDITIONER;  // CONJUGATE_GRADIENT only
+    double solver_tolerance = 0;        // CONJUGATE_GRADIENT only
+    double anchor_stiffness = 0;        // penalty weight of the anchors, 0 for hard constraints
+    bool valid = false;                 // false until a system has been built
+
+    // everything but the anchors agrees, so a border on the system can account for them
+    bool SameSystem(const ConstraintSignature & r) const {
+        return valid && r.valid && weight_type == r.weight_type && constraint_mode == r.constraint_mode
+               && linear_solver == r.linear_solver && preconditioner == r.preconditioner
+               && solver_tolerance == r.solver_tolerance;
+    }
+    bool operator==(const ConstraintSignature & r) const {
+        return SameSystem(r) && anchor_indices == r.anchor_indices && anchor_stiffness == r.anchor_stiffness;
+    }
+    bool operator!=(const ConstraintSignature & r) const { return !(*this == r); }
+};
+
+////////// struct FactorizationCounter //////////
+// how many symbolic analyses (ordering + elimination tree) and
+// numeric factorizations the linear solver has run so far
+struct FactorizationCounter {
+    size_t analyses = 0;
+    size_t factorizations = 0;
+
+    friend std::ostream & operator<< (std::ostream & out, const FactorizationCounter & c) {
+        return out << c.analyses << " analyses, " << c.factorizations << " factorizations";
+    }
+};
+
+////////// struct Adjacency //////////
+// compressed one-ring adjacency, built once when the mesh is loaded.
+// the neighbors of vertex i are neighbors[offsets[i]] ... neighbors[offsets[i+1]-1]
+// in OneRingVertex order, weights[e] is the weight of the edge to neighbors[e]
+// and reverse[e] the index of the opposite edge (-1 if there is none)
+struct Adjacency {
+    std::vector<int> offsets;
+    std::vector<int> neighbors;
+    std::vector<int> reverse;
+    std::vector<double> weights;
+
+    int Begin(int i) const { return offsets[i]; }
+    int End(int i) const { return offsets[i+1]; }
+    int Valence(int i) const { return offsets[i+1] - offsets[i]; }
+};
+
+////////// struct DeformOptions //////////
+// when Mesh::Deform stops iterating, whichever limit is reached first
+struct DeformOptions {
+    int max_iterations = 10;
+    double tolerance = 0;       // stop once the relative energy decrease falls below it, 0 to disable
+    double time_budget = 0;     // seconds, 0 for no limit
+    bool track_energy = true;   // evaluate the energy even if the tolerance does not need it
+};
+
+////////// struct DeformStats //////////
+// what happened in one call of Mesh::Deform
+struct DeformStats {
+    std::vector<double> energies;   // ARAP energy after each local/global iteration
+    std::vector<double> times;      // seconds since the start of Deform() at the end of each iteration
+    int iterations = 0;
+    bool converged = false;         // stopped because of the tolerance
+};
+
+////////// struct AnchorTerm //////////
+// contribution w * anchors[anchor] of an anchor neighbor to row handle of b_init
+struct AnchorTerm {
+    int handle;
+    int anchor;
+    double weight;
+};
+
+////////// struct ConstraintUpdate //////////
+// anchors added and removed since L was factorized. instead of refactorizing,
+// Deform solves the bordered system
+//   [ L    B ] [ x ]   [ b ]
+//   [ B^T  D ] [ v ] = [ g ]
+// through the Schur complement S = D - B^T L^-1 B, where the border holds one
+// unknown per changed anchor: the position of an eliminated vertex that became
+// free (column L_HR of B, rows L_RR of D) or the force that keeps a handle that
+// became an anchor in place (unit column of B, zero in D). soft anchors put
+// their stiffness s into D, +s for a freed vertex and -1/s for a handle. with
+// FIXED_LAPLACIAN the border holds every anchor but the hard grounds of L
+struct ConstraintUpdate {
+    ConstraintSignature signature;      // constraints the update was built for, invalid if there is none
+    std::vector<int> border;            // sorted changed vertices, freed ones have handleMap -1
+    std::vector<Eigen::VectorXd> z;     // L^-1 B, one column per border vertex
+    Eigen::PartialPivLU<Eigen::MatrixXd> schur; // factorization of S
+
+    bool Active() const { return signature.valid; }
+    bool Contains(int v) const { return std::binary_search(border.begin(), border.end(), v); }
+    void Clear() { signature.valid = false; border.clear(); z.clear(); }
+};
+
+////////// struct HEdgePool //////////
+// structure-of-arrays storage of the half edges, they refer to each other and
+// to vertices and faces by index (-1 for none). half edge 3f+k is the interior
+// half edge of face f starting at corner k, the boundary half edges follow
+// after the 3*#faces interior ones
+struct HEdgePool {
+    std::vector<int> twin, prev, next;  // twin/previous/next half edges
+    std::vector<int> start;             // start vertex
+    std::vector<int> face;              // left face, -1 for boundary half edges
+    std::vector<char> boundary;         // flag for boundary edge
+    std::vector<char> valid;
+    std::vector<char> flag;             // free for marking in boundary loop counting
+
+    int Size() const { return (int)twin.size(); }
+    void Grow(int count, bool is_boundary) {
+        int size = Size() + count;
+        twin.resize(size, -1);
+        prev.resize(size, -1);
+        next.resize(size, -1);
+        start.resize(size, -1);
+        face.resize(size, -1);
+        boundary.resize(size, is_boundary);
+        valid.resize(size, true);
+        flag.resize(size, false);
+    }
+};
+
+////////// struct VertexPool //////////
+// the positions are not stored here, they are the columns of Mesh::p_prime
+struct VertexPool {
+    std::vector<Vector3d> normal;   // normal vector for smooth shading rendering
+    std::vector<Vector3d> color;    // color value for curvature displaying
+    std::vector<int> he;            // one of half edge starts with this vertex
+    std::vector<int> flag;          // 0 for unselected, 1 for selected
+    std::vector<char> valid;
+    std::vector<VERTEX_TYPE> type;
+
+    int Size() const { return (int)he.size(); }
+    void Grow(int count) {
+        int size = Size() + count;
+        normal.resize(size);
+        color.resize(size);
+        he.resize(size, -1);
+        flag.resize(size, 0);
+        valid.resize(size, true);
+        type.resize(size, HANDLE);
+    }
+};
+
+////////// struct FacePool //////////
+struct FacePool {
+    std::vector<int> he;            // one of the half edges of the face
+    std::vector<char> valid;
+
+    int Size() const { return (int)he.size(); }
+    void Grow(int count) {
+        int size = Size() + count;
+        he.resize(size, -1);
+        valid.resize(size, true);
+    }
+};
 
 // other helper functions
 inline void SetPrevNext(HEdge *e1, HEdge *e2);
 inline void SetTwin(HEdge *e1, HEdge *e2);
 inline void SetFace(Face *f, HEdge *e);
 
+// HEdge, Vertex and Face are handles of an element in the pools of their mesh,
+// the mesh keeps one handle per element so that pointers to them stay valid
+// until the mesh is cleared. their functions are defined after class Mesh
+
 ////////// class HEdge //////////
 class HEdge {
 private:
-    HEdge *twin, *prev, *next;	// twin/previous/next half edges
-    Vertex *start;				// start vertex
-    Face *face;					// left face
-    bool boundary;				// flag for boundary edge
-
-    bool valid;
-
-    // it's for count boundary loop use,
-    // you can use it freely for marking in boundary loop counting
-    // and connected component counting
-    bool flag;
-
+    Mesh *mesh;
+    int index;                  // index in Mesh::he_pool
 public:
     /////////////////////////////////////
     // constructor
-    HEdge(bool b=false) {
-        boundary = b;
-        twin = prev = next = NULL;
-        start = NULL;
-        face = NULL;
-        flag = false;
-        valid = true;
-    }
+    HEdge(Mesh *m = NULL, int i = -1) : mesh(m), index(i) { }
     /////////////////////////////////////
     // access functions
-    HEdge*  Twin() const { return twin; }
-    HEdge*  Prev() const { return prev; }
-    HEdge*  Next() const { return next; }
-    Vertex* Start() const { return start; }
-    Vertex* End() const { return next->start; } // for convenience
-    Face*   LeftFace() const { return face; }
-    bool    Flag() const { return flag; }
-
-    HEdge*  SetTwin(HEdge* e) { return twin = e; }
-    HEdge*  SetPrev(HEdge* e) { return prev = e; }
-    HEdge*  SetNext(HEdge* e) { return next = e; }
-    Vertex* SetStart(Vertex* v) { return start = v; }
-    Face*   SetFace(Face* f) { return face = f; }
-    bool    SetFlag(bool b) { return flag = b; }
-    bool    SetValid(bool b) { return valid = b; }
-    bool    IsBoundary() const { return boundary; }
-    bool    IsValid() const { return valid; }
+    inline HEdge*  Twin() const;
+    inline HEdge*  Prev() const;
+    inline HEdge*  Next() const;
+    inline Vertex* Start() const;
+    inline Vertex* End() const; // for convenience
+    inline Face*   LeftFace() const;
+    inline bool    Flag() const;
+    int            Index() const { return index; }
+
+    inline HEdge*  SetTwin(HEdge* e);
+    inline HEdge*  SetPrev(HEdge* e);
+    inline HEdge*  SetNext(HEdge* e);
+    inline Vertex* SetStart(Vertex* v);
+    inline Face*   SetFace(Face* f);
+    inline bool    SetFlag(bool b);
+    inline bool    SetValid(bool b);
+    inline bool    IsBoundary() const;
+    inline bool    IsValid() const;
 };
 
 ////////// class OneRingHEdge //////////
@@ -90,10 +286,11 @@ public:
 // of a given vertex, please see Vertex::IsBoundary() for its usage
 class OneRingHEdge {
 private:
-    HEdge *start, *next;
+    Mesh *mesh;
+    int start, next;
 public:
-    OneRingHEdge(const Vertex * v);	// constructor
-    HEdge * NextHEdge();			// iterator
+    inline OneRingHEdge(const Vertex * v);	// constructor
+    inline HEdge * NextHEdge();			// iterator
 };
 
 ////////// class OneRingVertex //////////
@@ -110,148 +307,183 @@ public:
 ////////// class Vertex //////////
 class Vertex {
 private:
-    Vector3d position;	// position (x,y,z) in space
-    Vector3d normal;	// normal vector for smooth shading rendering
-    Vector3d color;		// color value for curvature displaying
-    HEdge *he;			// one of half edge starts with this vertex
-    int index;			// index in the Mesh::vList, DO NOT UPDATE IT
-    int flag;           // 0 for unselected, 1 for selected
-    bool valid;
-    VERTEX_TYPE vertex_type;
+    Mesh *mesh;
+    int index;			// index in the Mesh::vList and Mesh::v_pool, DO NOT UPDATE IT
 public:
-    vector<HEdge*> adjHEdges; // for reading object only, do not use it in other place
-
-    // constructors
-    Vertex() : he(NULL), flag(0), valid(true) { }
-    Vertex(const Vector3d & v) : he(NULL), position(v), flag(0), valid(true) { }
-    Vertex(double x, double y, double z) : he(NULL), position(x,y,z), flag(0), valid(true) { }
+    // constructor
+    Vertex(Mesh *m = NULL, int i = -1) : mesh(m), index(i) { }
 
     // access functions
-    const Vector3d & Position() const { return position; }
-    const Vector3d & Normal() const { return normal; }
-    const Vector3d & Color() const { return color; }
-    HEdge * HalfEdge() const { return he; }
+    inline const Vector3d & Position() const;
+    inline const Vector3d & Normal() const;
+    inline const Vector3d & Color() const;
+    inline HEdge * HalfEdge() const;
     int Index() const { return index; }
-    int Flag() const { return flag; }
-    const Vector3d & SetPosition(const Vector3d & p) { return position = p; }
-    const Vector3d & SetNormal(const Vector3d & n) { return normal = n; }
-    const Vector3d & SetColor(const Vector3d & c) { return color = c; }
-    HEdge * SetHalfEdge(HEdge * he) { return Vertex::he = he; }
-    int SetIndex(int index) { return Vertex::index = index; }
-
-    int SetFlag(int value) { return Vertex::flag = value; }
-    VERTEX_TYPE Type(){ return vertex_type; }
-    void SetType(VERTEX_TYPE _type) { vertex_type = _type; }
-    
-    bool IsValid() const { return valid; }
-    bool SetValid(bool b) { return valid = b; }
+    inline int Flag() const;
+    inline const Vector3d & SetPosition(const Vector3d & p);
+    inline const Vector3d & SetNormal(const Vector3d & n);
+    inline const Vector3d & SetColor(const Vector3d & c);
+    inline HEdge * SetHalfEdge(HEdge * he);
+    Mesh * Owner() const { return mesh; }
+
+    inline int SetFlag(int value);
+    inline VERTEX_TYPE Type();
+    inline void SetType(VERTEX_TYPE _type);
+
+    inline bool IsValid() const;
+    inline bool SetValid(bool b);
 
     // check for boundary vertex
-    bool IsBoundary() const {
-        OneRingHEdge ring(this);
-        HEdge *curr = NULL;
-        while (curr=ring.NextHEdge()) if (curr->IsBoundary()) return true;
-        return false;
-    }
+    inline bool IsBoundary() const;
 
     // compute the valence (# of neighbor vertices)
-    int Valence() const {
-        int count = 0;
-        OneRingVertex ring(this);
-        Vertex *curr = NULL;
-        while (curr=ring.NextVertex()) count++;
-        return count;
-    }
+    inline int Valence() const;
 };
 
 ////////// class Face //////////
 class Face {
 private:
-    HEdge * he;
-    bool valid;
+    Mesh *mesh;
+    int index;                  // index in Mesh::fList and Mesh::f_pool
 public:
     // constructor
-    Face() : he(NULL), valid(true) { }
+    Face(Mesh *m = NULL, int i = -1) : mesh(m), index(i) { }
 
     // access function
-    HEdge * HalfEdge() const { return he; }
-    HEdge * SetHalfEdge(HEdge * he) { return Face::he = he; }
+    inline HEdge * HalfEdge() const;
+    inline HEdge * SetHalfEdge(HEdge * he);
+    int Index() const { return index; }
 
     // check for boundary face
-    bool IsBoundary() {
-        HEdge *curr = he;
-        do {
-            if (curr->Twin()->IsBoundary()) return true;
-            curr = curr->Next();
-        } while (curr != he);
-        return false;
-    }
-    bool SetValid(bool b) { return valid = b; }
-    bool IsValid() const { return valid;}
+    inline bool IsBoundary();
+    inline bool SetValid(bool b);
+    inline bool IsValid() const;
 };
 
 ////////// class Mesh //////////
 class Mesh {
 public:
+    HEdgePool he_pool;      // connectivity of the half edges
+    VertexPool v_pool;      // attributes of the vertices
+    FacePool f_pool;        // attributes of the faces
+    std::vector<HEdge> he_handles;  // one handle per element of the pools,
+    std::vector<Vertex> v_handles;  // the lists below point into them
+    std::vector<Face> f_handles;
     HEdgeList heList;		// list of NON-boundary half edges
     HEdgeList bheList;		// list of boundary half egdes
     VertexList vList;		// list of vertices
     FaceList fList;			// list of faces
-    Eigen::Matrix<double, 3, Eigen::Dynamic> p, p_prime;
+    Eigen::Matrix<double, 3, Eigen::Dynamic> p, p_prime;   // rest and current positions, Vertex::Position() views p_prime
     Eigen::Matrix<int, 3, Eigen::Dynamic> faces;
-    Eigen::SparseMatrix<double> weights;
+    Adjacency adjacency;
+    Eigen::Matrix<double, 3, Eigen::Dynamic> edge_vectors;  // rest pose p_i - p_j of every adjacency edge
     Eigen::SparseMatrix<double> L;
-    Eigen::Matrix<double, 3, Eigen::Dynamic> b, b_init ;
+    PointRows b, b_init;                // right hand sides, one row per handle
     Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver;
-    vector<Eigen::Matrix3d> rotations;
-    unordered_map<int, Point> anchors;
-    vector<int> handleMap;
+    Matrix iterative_solver;            // copy of L for CONJUGATE_GRADIENT, with its preconditioner
+    std::vector<Eigen::Matrix3d> rotations;
+    std::unordered_map<int, Point> anchors;
+    std::vector<int> handleMap;
+    std::vector<int> handleVertices;    // inverse of handleMap, vertex index of each handle
     int handle_num;
+    std::vector<AnchorTerm> anchor_terms;   // anchor couplings of the handle rows
+    ConstraintSignature signature;      // constraints L was built and factorized for
+    ConstraintUpdate constraint_update; // changes of the constraints since then
+    // ELIMINATION: at most this many anchors that changed since L was factorized go on
+    // the border, the next change refactorizes L. a border vertex costs one solve when it
+    // joins and the Schur complement grows with the square of the count, 0 always refactorizes
+    int max_constraint_update = 32;
+    CONSTRAINT_MODE constraint_mode = ELIMINATION;  // how the anchors enter the linear system
+    double anchor_stiffness = 0;        // FIXED_LAPLACIAN: penalty weight of the anchors, 0 for hard constraints
+    LINEAR_SOLVER linear_solver = LDLT; // how the global step solves L x = b
+    PRECONDITIONER preconditioner = INCOMPLETE_CHOLESKY;   // CONJUGATE_GRADIENT only
+    double solver_tolerance = 1e-10;    // CONJUGATE_GRADIENT: relative residual to stop at
+    int max_solver_iterations = 2000;   // CONJUGATE_GRADIENT: iterations per solve at most
+    int num_threads = 0;                // threads of the parallel loops, 0 for all cores
+    ROTATION_SOLVER rotation_solver = FAST_SVD; // how EstimateRotations fits the rotations
+    bool warm_start = false;            // start from the previous rotations if the constraints kept their topology
+    bool read_mesh_cache = true;        // LoadObjFile reads <obj>.cache if it matches the obj file
+    bool write_mesh_cache = false;      // LoadObjFile writes <obj>.cache after parsing the obj file
+    bool cache_weights = true;          // the written cache includes the cotangent weights
+    std::vector<double> cotangent_weights;  // summed cotangent weights from the cache, empty if not cached
+    std::vector<int> pattern_outer, pattern_inner;  // sparsity pattern of L the solver was analyzed for
+    FactorizationCounter factorization_counter;
+    size_t topology_version = 0;        // bumped by every LoadObjFile
+    size_t vertex_version = 0;          // bumped whenever p_prime or the vertex colors change
+#ifdef ARAP_PROFILE
+    DeformProfile profile;              // stage times and counters of Deform, see profile.hpp
+#endif
 
     // constructor & destructors
     Mesh() { }
     ~Mesh() { Clear(); }
+    Mesh(const Mesh &) = delete;    // the element handles point back to their mesh
+    Mesh & operator=(const Mesh &) = delete;
 
     // access functions
-    const HEdgeList Edges() const { return heList; }
-    const HEdgeList BoundaryEdges() const { return bheList; }
-    const VertexList Vertices() const { return vList; }
-    const FaceList Faces() const { return fList; }
+    HEdgeSpan Edges() const { return heList; }
+    HEdgeSpan BoundaryEdges() const { return bheList; }
+    VertexSpan Vertices() const { return vList; }
+    FaceSpan Faces() const { return fList; }
+
+    // handles of the elements with the given pool index, NULL for -1
+    HEdge * HEdgeAt(int i) { return i < 0 ? NULL : &he_handles[i]; }
+    Vertex * VertexAt(int i) { return i < 0 ? NULL : &v_handles[i]; }
+    Face * FaceAt(int i) { return i < 0 ? NULL : &f_handles[i]; }
 
     // functions for loading obj files,
     // you DO NOT need to understand and use them
-    void AddVertex(Vertex *v) { vList.push_back(v); v->SetType(HANDLE); }
-    void AddFace(int v1, int v2, int v3);
+    void BuildElements();
+    void BuildConnectivity();
+    void BuildHandles();
+    bool LoadMeshCache(const char *cache_path, const MappedFile &source);
+    bool SaveMeshCache(const char *cache_path, const MappedFile &source);
     void Clear() {
-        size_t i;
-        for (i=0; i<heList.size(); i++) delete heList[i];
-        for (i=0; i<bheList.size(); i++) delete bheList[i];
-        for (i=0; i<vList.size(); i++) delete vList[i];
-        for (i=0; i<fList.size(); i++) delete fList[i];
+        he_pool = HEdgePool();
+        v_pool = VertexPool();
+        f_pool = FacePool();
+        he_handles.clear();
+        v_handles.clear();
+        f_handles.clear();
         heList.clear();
         bheList.clear();
         vList.clear();
         fList.clear();
     }
-    const vector<Vertex*> GetNeighbors(Vertex*);
+    const std::vector<Vertex*> GetNeighbors(Vertex*);
+    void BuildAdjacency();
 
     // Deform functions
+    void SetNumThreads(int n) { num_threads = n; }
+    int NumThreads() const;
     void Deform(int num_iterations, WEIGHT_TYPE);
-    void SetConstraints(const char*);
-    void SetConstraints(vector<int>);
+    DeformStats Deform(const DeformOptions &, WEIGHT_TYPE);
+    bool SetConstraints(const char*);
+    void SetConstraints(std::vector<int>);
     void ResetConstraints();
-    void SetAnchors(const char*);
-    void SetAnchors(vector<int>);
+    bool SetAnchors(const char*);
+    void SetAnchors(std::vector<int>);
     void SetHandles();
     void InitRotations();
     void InitWeights(WEIGHT_TYPE);
     void InitUniformWeights();
     void InitCotangentWeights();
     void InitHandleMapping();
+    void InitEdgeVectors();
+    Eigen::Matrix3d Covariance(int i) const;
     void EstimateRotations();
+    ConstraintSignature GetSignature(WEIGHT_TYPE) const;
     void BuildLinearSystem();
+    void FactorizeLinearSystem();
+    void BuildAnchorTerms();
+    bool UpdateConstraints(const ConstraintSignature &);
     void SolveLinearSystem();
-    void UpdateVertices();
+    void SolveConstraintUpdate(PointRows &x);
+    void SolveFactorized(const PointRows &rhs, PointRows &x) const;
+    void SolveIterative(const PointRows &rhs, PointRows &x);
+    double Energy() const;
+
+    Vector3d RestPosition(int i) const { return Vector3d(p(0,i), p(1,i), p(2,i)); }
 
     Vector3d MinCoord() const {
         Vector3d minCoord;
@@ -268,13 +500,112 @@ public:
     }
 
     bool LoadObjFile(const char * filename);
+    bool SaveObjFile(const char * filename) const;
+    bool SaveBinaryFile(const char * filename) const;
+    bool LoadBinaryFile(const char * filename);
 
 };
 
+/////////////////////////////////////////
+// implementation of the element handles
+inline HEdge*  HEdge::Twin() const { return mesh->HEdgeAt(mesh->he_pool.twin[index]); }
+inline HEdge*  HEdge::Prev() const { return mesh->HEdgeAt(mesh->he_pool.prev[index]); }
+inline HEdge*  HEdge::Next() const { return mesh->HEdgeAt(mesh->he_pool.next[index]); }
+inline Vertex* HEdge::Start() const { return mesh->VertexAt(mesh->he_pool.start[index]); }
+inline Vertex* HEdge::End() const { return mesh->VertexAt(mesh->he_pool.start[mesh->he_pool.next[index]]); }
+inline Face*   HEdge::LeftFace() const { return mesh->FaceAt(mesh->he_pool.face[index]); }
+inline bool    HEdge::Flag() const { return mesh->he_pool.flag[index]; }
+
+inline HEdge*  HEdge::SetTwin(HEdge* e) { mesh->he_pool.twin[index] = e ? e->index : -1; return e; }
+inline HEdge*  HEdge::SetPrev(HEdge* e) { mesh->he_pool.prev[index] = e ? e->index : -1; return e; }
+inline HEdge*  HEdge::SetNext(HEdge* e) { mesh->he_pool.next[index] = e ? e->index : -1; return e; }
+inline Vertex* HEdge::SetStart(Vertex* v) { mesh->he_pool.start[index] = v ? v->Index() : -1; return v; }
+inline Face*   HEdge::SetFace(Face* f) { mesh->he_pool.face[index] = f ? f->Index() : -1; return f; }
+inline bool    HEdge::SetFlag(bool b) { mesh->he_pool.flag[index] = b; return b; }
+inline bool    HEdge::SetValid(bool b) { mesh->he_pool.valid[index] = b; return b; }
+inline bool    HEdge::IsBoundary() const { return mesh->he_pool.boundary[index]; }
+inline bool    HEdge::IsValid() const { return mesh->he_pool.valid[index]; }
+
+inline OneRingHEdge::OneRingHEdge(const Vertex * v) {
+    mesh = v ? v->Owner() : NULL;
+    start = next = v ? mesh->v_pool.he[v->Index()] : -1;
+}
+
+inline HEdge * OneRingHEdge::NextHEdge() {
+    if (next < 0) return NULL;
+    int ret = next;
+    next = mesh->he_pool.twin[mesh->he_pool.prev[next]];
+    if (next == start) next = -1;
+    return mesh->HEdgeAt(ret);
+}
+
+// a vertex position is a view of its column in p_prime, so the solver and the
+// vertices always agree on where the vertices are
+static_assert(sizeof(Vector3d) == 3 * sizeof(double) && std::is_standard_layout<Vector3d>::value,
+              "Vector3d has to alias three packed doubles");
+inline const Vector3d & Vertex::Position() const {
+    return *reinterpret_cast<const Vector3d *>(mesh->p_prime.data() + 3 * index);
+}
+inline const Vector3d & Vertex::Normal() const { return mesh->v_pool.normal[index]; }
+inline const Vector3d & Vertex::Color() const { return mesh->v_pool.color[index]; }
+inline HEdge * Vertex::HalfEdge() const { return mesh->HEdgeAt(mesh->v_pool.he[index]); }
+inline int Vertex::Flag() const { return mesh->v_pool.flag[index]; }
+inline const Vector3d & Vertex::SetPosition(const Vector3d & p) {
+    mesh->p_prime.col(index) = Point(p.X(), p.Y(), p.Z());
+    mesh->vertex_version++;
+    return Position();
+}
+inline const Vector3d & Vertex::SetNormal(const Vector3d & n) { return mesh->v_pool.normal[index] = n; }
+inline const Vector3d & Vertex::SetColor(const Vector3d & c) { mesh->vertex_version++; return mesh->v_pool.color[index] = c; }
+inline HEdge * Vertex::SetHalfEdge(HEdge * he) { mesh->v_pool.he[index] = he ? he->Index() : -1; return he; }
+inline int Vertex::SetFlag(int value) { return mesh->v_pool.flag[index] = value; }
+inline VERTEX_TYPE Vertex::Type() { return mesh->v_pool.type[index]; }
+inline void Vertex::SetType(VERTEX_TYPE _type) { mesh->v_pool.type[index] = _type; }
+inline bool Vertex::IsValid() const { return mesh->v_pool.valid[index]; }
+inline bool Vertex::SetValid(bool b) { mesh->v_pool.valid[index] = b; return b; }
+
+/* the one-ring walks below stay on the index arrays */
+inline bool Vertex::IsBoundary() const {
+    const HEdgePool &pool = mesh->he_pool;
+    int start = mesh->v_pool.he[index], e = start;
+    if (e < 0) return false;
+    do {
+        if (pool.boundary[e]) return true;
+        e = pool.twin[pool.prev[e]];
+    } while (e != start);
+    return false;
+}
+
+inline int Vertex::Valence() const {
+    const HEdgePool &pool = mesh->he_pool;
+    int start = mesh->v_pool.he[index], e = start, count = 0;
+    if (e < 0) return 0;
+    do {
+        count++;
+        e = pool.twin[pool.prev[e]];
+    } while (e != start);
+    return count;
+}
+
+inline HEdge * Face::HalfEdge() const { return mesh->HEdgeAt(mesh->f_pool.he[index]); }
+inline HEdge * Face::SetHalfEdge(HEdge * he) { mesh->f_pool.he[index] = he ? he->Index() : -1; return he; }
+inline bool Face::SetValid(bool b) { mesh->f_pool.valid[index] = b; return b; }
+inline bool Face::IsValid() const { return mesh->f_pool.valid[index]; }
+
+inline bool Face::IsBoundary() {
+    const HEdgePool &pool = mesh->he_pool;
+    int start = mesh->f_pool.he[index], e = start;
+    do {
+        if (pool.boundary[pool.twin[e]]) return true;
+        e = pool.next[e];
+    } while (e != start);
+    return false;
+}
+
 // other helper functions
 inline void SetPrevNext(HEdge *e1, HEdge *e2) { e1->SetNext(e2); e2->SetPrev(e1); }
 inline void SetTwin(HEdge *e1, HEdge *e2) { e1->SetTwin(e2); e2->SetTwin(e1); }
 inline void SetFace(Face *f, HEdge *e) { f->SetHalfEdge(e); e->SetFace(f); }
 
 
-#endif // __MESH_H__
\ No newline at end of file
+#endif // __MESH_H__
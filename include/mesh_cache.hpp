@@ -0,0 +1,66 @@
+#ifndef __MESH_CACHE_H__
+#define __MESH_CACHE_H__
+
+#include <cstddef>
+#include <cstdint>
+
+////////// mesh cache format //////////
+// binary copy of a loaded obj file, stored next to it as <obj>.cache and
+// valid as long as the size and hash of the obj file match the header.
+// the header is followed by these arrays, each padded to a multiple of 8 bytes:
+//   double  p[3 * num_vertices]            column-major like Mesh::p
+//   int32_t faces[3 * num_faces]           column-major like Mesh::faces
+//   int32_t twins[3 * num_faces]           twin of half edge 3f+k, b < 0 for boundary half edge -1-b
+//   int32_t boundary_next[num_boundary]    next boundary half edge
+//   int32_t offsets[num_vertices + 1]      Adjacency::offsets
+//   int32_t neighbors[num_edges]           Adjacency::neighbors
+//   int32_t reverse[num_edges]             Adjacency::reverse
+//   double  weights[num_edges]             cotangent weights, only with MESH_CACHE_COTANGENT
+// Mesh::LoadMeshCache maps the file, validates it in place and copies the arrays
+// into the vectors of the mesh, which own and modify them; what the cache saves
+// is the obj parsing and the connectivity construction, not the copy
+const char MESH_CACHE_MAGIC[8] = {'A', 'R', 'A', 'P', 'M', 'E', 'S', 'H'};
+const uint32_t MESH_CACHE_VERSION = 1;
+const uint32_t MESH_CACHE_COTANGENT = 1;   // flag: the cotangent weights are stored
+
+struct MeshCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t source_size;       // bytes of the obj file
+    uint64_t source_hash;       // MeshCacheHash of the obj file
+    int32_t num_vertices;
+    int32_t num_faces;
+    int32_t num_boundary;       // boundary half edges
+    int32_t num_edges;          // directed edges of the adjacency
+};
+
+// 64-bit FNV-1a
+inline uint64_t MeshCacheHash(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+inline size_t MeshCachePadded(size_t bytes) { return (bytes + 7) & ~(size_t)7; }
+
+////////// deformed mesh format //////////
+// output of Mesh::SaveBinaryFile, the header is followed by
+//   double  p_prime[3 * num_vertices]      column-major like Mesh::p_prime
+//   int32_t faces[3 * num_faces]           column-major like Mesh::faces
+// its own magic keeps it apart from a mesh cache
+const char MESH_OUTPUT_MAGIC[8] = {'A', 'R', 'A', 'P', 'D', 'E', 'F', 'M'};
+const uint32_t MESH_OUTPUT_VERSION = 1;
+
+struct MeshOutputHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;             // none yet
+    int32_t num_vertices;
+    int32_t num_faces;
+};
+
+#endif // __MESH_CACHE_H__
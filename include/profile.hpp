@@ -0,0 +1,97 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+
+// stages of Mesh::Deform the profile keeps the wall time of
+enum PROFILE_STAGE{
+    PROFILE_INIT_ROTATIONS,
+    PROFILE_INIT_WEIGHTS,
+    PROFILE_INIT_HANDLE_MAPPING,
+    PROFILE_BUILD_LINEAR_SYSTEM,    // assembly and factorization of L
+    PROFILE_UPDATE_CONSTRAINTS,     // Schur complement of changed anchors instead
+    PROFILE_BUILD_ANCHOR_TERMS,
+    PROFILE_INIT_EDGE_VECTORS,
+    PROFILE_ESTIMATE_ROTATIONS,
+    PROFILE_SOLVE_LINEAR_SYSTEM,    // right hand side, solve and update of p_prime
+    PROFILE_ENERGY,
+    PROFILE_STAGES
+};
+
+////////// struct DeformProfile //////////
+// wall time and number of calls per stage plus counters of the solver, summed
+// over all Deform calls since the last Reset(). Mesh only has a profile when
+// built with ARAP_PROFILE (cmake -DARAP_PROFILE=ON), otherwise the
+// ARAP_PROFILE_* macros below expand to nothing
+struct DeformProfile {
+    double seconds[PROFILE_STAGES] = {};
+    size_t calls[PROFILE_STAGES] = {};
+    size_t deforms = 0;
+    size_t iterations = 0;
+    size_t solver_iterations = 0;       // conjugate gradient iterations of the global steps
+    size_t factorization_reuses = 0;    // Deform calls that kept the factorization of L
+    size_t constraint_updates = 0;      // of them, calls that had to update it for changed anchors
+    size_t nonzeros = 0;                // nnz(L) of the last built system
+    int handles = 0;                    // free vertices of the last built system
+    int anchors = 0;                    // anchors of the last Deform call
+
+    void Reset() { *this = DeformProfile(); }
+
+    double TotalSeconds() const {
+        double total = 0;
+        for (int s = 0; s < PROFILE_STAGES; s++) total += seconds[s];
+        return total;
+    }
+
+    static const char * StageName(int stage) {
+        static const char *names[PROFILE_STAGES] = {
+            "InitRotations", "InitWeights", "InitHandleMapping", "BuildLinearSystem", "UpdateConstraints",
+            "BuildAnchorTerms", "InitEdgeVectors", "EstimateRotations", "SolveLinearSystem", "Energy"
+        };
+        return names[stage];
+    }
+
+    friend std::ostream & operator<< (std::ostream & out, const DeformProfile & profile) {
+        out << profile.deforms << " deforms, " << profile.iterations << " iterations, "
+            << profile.solver_iterations << " solver iterations, "
+            << profile.factorization_reuses << " factorization reuses, "
+            << profile.constraint_updates << " constraint updates, " << profile.handles << " handles, "
+            << profile.anchors << " anchors, nnz(L) " << profile.nonzeros;
+        for (int s = 0; s < PROFILE_STAGES; s++) {
+            if (profile.calls[s] == 0) continue;
+            out << "\n  " << StageName(s) << ": " << profile.seconds[s] * 1000 << " ms in "
+                << profile.calls[s] << (profile.calls[s] == 1 ? " call" : " calls");
+        }
+        return out;
+    }
+};
+
+////////// class ProfileTimer //////////
+// adds the time until it goes out of scope to a stage of the profile
+class ProfileTimer {
+private:
+    DeformProfile &profile;
+    PROFILE_STAGE stage;
+    std::chrono::steady_clock::time_point start;
+public:
+    ProfileTimer(DeformProfile &profile, PROFILE_STAGE stage)
+        : profile(profile), stage(stage), start(std::chrono::steady_clock::now()) { }
+    ~ProfileTimer() {
+        profile.seconds[stage] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        profile.calls[stage]++;
+    }
+    ProfileTimer(const ProfileTimer &) = delete;
+    ProfileTimer & operator=(const ProfileTimer &) = delete;
+};
+
+#ifdef ARAP_PROFILE
+#define ARAP_PROFILE_STAGE(stage) ProfileTimer profile_timer(profile, stage)
+#define ARAP_PROFILE_COUNT(statement) statement
+#else
+#define ARAP_PROFILE_STAGE(stage)
+#define ARAP_PROFILE_COUNT(statement)
+#endif
+
+#endif // __PROFILE_H__
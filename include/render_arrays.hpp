@@ -0,0 +1,160 @@
+#ifndef __RENDER_ARRAYS_H__
+#define __RENDER_ARRAYS_H__
+
+#include <GL/gl.h>
+#include <cmath>
+#include <vector>
+#include "mesh.hpp"
+
+////////// class RenderArrays //////////
+// client-side vertex arrays of a mesh for glDrawElements/glDrawArrays, so a
+// frame is a handful of draw calls instead of one glVertex call per corner.
+// the index arrays are rebuilt when the mesh is reloaded, the positions and
+// normals only when Mesh::vertex_version changed since the last Update. they are
+// then rebuilt for every vertex: a Deform moves nearly all of them and the
+// normals of a moved vertex change its neighbors too, so tracking a dirty range
+// would not save work in the common case
+class RenderArrays {
+public:
+    std::vector<GLfloat> positions;         // 3 per vertex, from p_prime
+    std::vector<GLfloat> normals;           // 3 per vertex, area weighted vertex normals
+    std::vector<GLfloat> colors;            // 3 per vertex
+    std::vector<GLuint> triangles;          // 3 vertex indices per face
+    std::vector<GLuint> lines;              // 2 vertex indices per interior edge
+    std::vector<GLuint> boundary_lines;     // 2 vertex indices per boundary edge
+    std::vector<GLfloat> flat_positions;    // 9 per face, the corners are not shared
+    std::vector<GLfloat> flat_normals;      // 9 per face, the face normal at every corner
+
+    // brings the arrays up to date with the mesh
+    void Update(const Mesh & mesh) {
+        if (&mesh != source || mesh.topology_version != topology_version) {
+            source = &mesh;
+            topology_version = mesh.topology_version;
+            BuildIndices(mesh);
+            vertex_version = flat_version = (size_t)-1;
+        }
+        if (mesh.vertex_version != vertex_version) {
+            vertex_version = mesh.vertex_version;
+            BuildVertices(mesh);
+        }
+    }
+
+    // the unshared corners for flat shading, only built when it is drawn
+    void UpdateFlat(const Mesh & mesh) {
+        Update(mesh);
+        if (flat_version == vertex_version) return;
+        flat_version = vertex_version;
+        int m = (int)mesh.faces.cols();
+        flat_positions.resize(9 * (size_t)m);
+        flat_normals.resize(9 * (size_t)m);
+        for (int f = 0; f < m; f++) {
+            for (int k = 0; k < 3; k++) {
+                const GLfloat *p = &positions[3 * (size_t)mesh.faces(k, f)];
+                for (int c = 0; c < 3; c++) {
+                    flat_positions[9 * (size_t)f + 3 * k + c] = p[c];
+                    flat_normals[9 * (size_t)f + 3 * k + c] = (GLfloat)face_normals(c, f);
+                }
+            }
+        }
+    }
+
+    void DrawTriangles() const {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, positions.data());
+        glDrawElements(GL_TRIANGLES, (GLsizei)triangles.size(), GL_UNSIGNED_INT, triangles.data());
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+
+    void DrawSmoothTriangles(bool with_colors) const {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_NORMAL_ARRAY);
+        if (with_colors) glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, positions.data());
+        glNormalPointer(GL_FLOAT, 0, normals.data());
+        if (with_colors) glColorPointer(3, GL_FLOAT, 0, colors.data());
+        glDrawElements(GL_TRIANGLES, (GLsizei)triangles.size(), GL_UNSIGNED_INT, triangles.data());
+        if (with_colors) glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+
+    void DrawFlatTriangles() const {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, flat_positions.data());
+        glNormalPointer(GL_FLOAT, 0, flat_normals.data());
+        glDrawArrays(GL_TRIANGLES, 0, (GLsizei)(flat_positions.size() / 3));
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+
+    void DrawLines(const std::vector<GLuint> & indices) const {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, positions.data());
+        glDrawElements(GL_LINES, (GLsizei)indices.size(), GL_UNSIGNED_INT, indices.data());
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+
+private:
+    const Mesh *source = NULL;
+    size_t topology_version = 0;
+    size_t vertex_version = (size_t)-1;
+    size_t flat_version = (size_t)-1;
+    Eigen::Matrix<double, 3, Eigen::Dynamic> face_normals;  // unnormalized, |n| is twice the area
+
+    void BuildIndices(const Mesh & mesh) {
+        triangles.assign(mesh.faces.data(), mesh.faces.data() + mesh.faces.size());
+
+        /* every interior edge once, the boundary edges are drawn on their own */
+        const HEdgePool &pool = mesh.he_pool;
+        lines.clear();
+        boundary_lines.clear();
+        for (int h = 0; h < pool.Size(); h++) {
+            if (!pool.valid[h]) continue;
+            int i = pool.start[h], j = pool.start[pool.next[h]];
+            if (pool.boundary[h]) {
+                boundary_lines.push_back(i);
+                boundary_lines.push_back(j);
+            }
+            else if (i < j && !pool.boundary[pool.twin[h]]) {
+                lines.push_back(i);
+                lines.push_back(j);
+            }
+        }
+    }
+
+    /* positions, then face normals in one pass over the faces and their area
+     * weighted sums at the vertices */
+    void BuildVertices(const Mesh & mesh) {
+        int n = (int)mesh.p_prime.cols(), m = (int)mesh.faces.cols();
+        const double *p = mesh.p_prime.data();
+        positions.resize(3 * (size_t)n);
+        for (size_t k = 0; k < positions.size(); k++) positions[k] = (GLfloat)p[k];
+
+        face_normals.resize(3, m);
+        #pragma omp parallel for schedule(static)
+        for (int f = 0; f < m; f++) {
+            Point p0 = mesh.p_prime.col(mesh.faces(0, f));
+            face_normals.col(f) = (mesh.p_prime.col(mesh.faces(1, f)) - p0).cross(mesh.p_prime.col(mesh.faces(2, f)) - p0);
+        }
+
+        Eigen::Matrix<double, 3, Eigen::Dynamic> vertex_normals = Eigen::Matrix<double, 3, Eigen::Dynamic>::Zero(3, n);
+        for (int f = 0; f < m; f++)
+            for (int k = 0; k < 3; k++) vertex_normals.col(mesh.faces(k, f)) += face_normals.col(f);
+        normals.resize(3 * (size_t)n);
+        for (int i = 0; i < n; i++) {
+            double length = vertex_normals.col(i).norm();
+            for (int c = 0; c < 3; c++) normals[3 * i + c] = length > 0 ? (GLfloat)(vertex_normals(c, i) / length) : 0;
+        }
+        for (int f = 0; f < m; f++) {
+            double length = face_normals.col(f).norm();
+            if (length > 0) face_normals.col(f) /= length;
+        }
+
+        colors.resize(3 * (size_t)n);
+        for (int i = 0; i < n; i++)
+            for (int c = 0; c < 3; c++) colors[3 * i + c] = (GLfloat)mesh.v_pool.color[i][c];
+    }
+};
+
+#endif // __RENDER_ARRAYS_H__
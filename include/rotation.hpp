@@ -0,0 +1,173 @@
+#ifndef __ROTATION_H__
+#define __ROTATION_H__
+
+#include <cmath>
+#include <Eigen/Core>
+#include <Eigen/SVD>
+
+// number of matrices processed together, one per SIMD lane
+#if defined(__AVX512F__)
+const int ROTATION_LANES = 8;
+#else
+const int ROTATION_LANES = 4;
+#endif
+
+// all matrices below are stored lane-interleaved: M[i][j][l] is entry (i,j) of the
+// matrix in lane l, so every loop over l maps onto SIMD registers
+namespace fast_rotation {
+
+const int L = ROTATION_LANES;
+const int JACOBI_SWEEPS = 4;
+const double TINY = 1e-60;
+
+// Jacobi conjugation S <- G^T S G of the symmetric S in the (P,Q) plane with the exact
+// angle that zeros S(P,Q), accumulated into V <- V G
+template <int P, int Q, int K>
+inline void JacobiConjugation(double S[3][3][L], double V[3][3][L]) {
+    #pragma omp simd
+    for (int l = 0; l < L; l++) {
+        /* TINY enters before the norm, so cos2^2 + sin2^2 = 1 even when d and o are of its size */
+        double d = S[P][P][l] - S[Q][Q][l];
+        double o = 2.0 * S[P][Q][l];
+        double a = std::fabs(d) + TINY;
+        double r = std::sqrt(a*a + o*o);
+        double cos2 = a / r;
+        double sin2 = std::copysign(1.0, d) * o / r;
+        double c = std::sqrt(0.5 * (1.0 + cos2));
+        double s = 0.5 * sin2 / c;
+
+        double spp = S[P][P][l], sqq = S[Q][Q][l], spq = S[P][Q][l], spk = S[P][K][l], sqk = S[Q][K][l];
+        S[P][P][l] = c*c*spp + 2.0*c*s*spq + s*s*sqq;
+        S[Q][Q][l] = s*s*spp - 2.0*c*s*spq + c*c*sqq;
+        S[P][Q][l] = S[Q][P][l] = (c*c - s*s)*spq + c*s*(sqq - spp);
+        S[P][K][l] = S[K][P][l] = c*spk + s*sqk;
+        S[Q][K][l] = S[K][Q][l] = c*sqk - s*spk;
+        for (int i = 0; i < 3; i++) {
+            double vp = V[i][P][l], vq = V[i][Q][l];
+            V[i][P][l] = c*vp + s*vq;
+            V[i][Q][l] = c*vq - s*vp;
+        }
+    }
+}
+
+// swap columns I and J of B and V where column J of B is longer,
+// one of them is negated so that V stays a rotation
+template <int I, int J>
+inline void SortColumns(double B[3][3][L], double V[3][3][L], double n[3][L]) {
+    #pragma omp simd
+    for (int l = 0; l < L; l++) {
+        bool swap = n[I][l] < n[J][l];
+        for (int k = 0; k < 3; k++) {
+            double bi = B[k][I][l], bj = B[k][J][l];
+            B[k][I][l] = swap ? bj : bi;
+            B[k][J][l] = swap ? -bi : bj;
+            double vi = V[k][I][l], vj = V[k][J][l];
+            V[k][I][l] = swap ? vj : vi;
+            V[k][J][l] = swap ? -vi : vj;
+        }
+        double ni = n[I][l], nj = n[J][l];
+        n[I][l] = swap ? nj : ni;
+        n[J][l] = swap ? ni : nj;
+    }
+}
+
+// Givens rotation G on rows (P,Q) that zeros B(Q,C), applied as B <- G B and X <- G X
+template <int P, int Q, int C>
+inline void Givens(double B[3][3][L], double X[3][3][L]) {
+    #pragma omp simd
+    for (int l = 0; l < L; l++) {
+        double bp = B[P][C][l] + TINY, bq = B[Q][C][l];
+        double inv = 1.0 / std::sqrt(bp*bp + bq*bq);
+        double c = bp * inv;
+        double s = bq * inv;
+        for (int k = 0; k < 3; k++) {
+            double p = B[P][k][l], q = B[Q][k][l];
+            B[P][k][l] = c*p + s*q;
+            B[Q][k][l] = c*q - s*p;
+        }
+        for (int k = 0; k < 3; k++) {
+            double p = X[P][k][l], q = X[Q][k][l];
+            X[P][k][l] = c*p + s*q;
+            X[Q][k][l] = c*q - s*p;
+        }
+    }
+}
+
+}
+
+// Rotation R = V U^T from the SVD S = U Sigma V^T of a covariance matrix, with the
+// reflection fixed by flipping the axis of the smallest singular value
+inline Eigen::Matrix3d SvdRotation(const Eigen::Matrix3d & S) {
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(S, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Matrix3d Ut = svd.matrixU().transpose();
+    Eigen::Matrix3d V = svd.matrixV();
+
+    Eigen::Matrix3d I;
+    I.setIdentity();
+    I(2,2) = (V * Ut).determinant();
+    return V * I * Ut;
+}
+
+// Rotations R = V U^T from the SVD S = U Sigma V^T of ROTATION_LANES matrices at once,
+// i.e. the rotations maximizing tr(R S) as fitted by Mesh::EstimateRotations.
+// U and V are kept proper rotations throughout, so the sign of det(S) ends up in the
+// smallest singular value; this is the same reflection fix-up the JacobiSVD path does
+// with the determinant. Branch free: the Jacobi sweeps are fixed and the column sorting
+// and QR steps use selects only. Agrees with SvdRotation to ~1e-13 wherever the
+// rotation is unique.
+inline void FastRotations(const double S_in[3][3][ROTATION_LANES], double R[3][3][ROTATION_LANES]) {
+    using namespace fast_rotation;
+    double A[3][3][L], S[3][3][L], V[3][3][L], B[3][3][L], X[3][3][L], n[3][L];
+
+    /* The rotation does not depend on the scale of S */
+    #pragma omp simd
+    for (int l = 0; l < L; l++) {
+        double norm = 0;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) norm += S_in[i][j][l] * S_in[i][j][l];
+        double inv = 1.0 / (std::sqrt(norm) + TINY);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) {
+                A[i][j][l] = S_in[i][j][l] * inv;
+                V[i][j][l] = X[i][j][l] = (i == j);
+            }
+    }
+
+    /* V: eigenvectors of A^T A */
+    #pragma omp simd
+    for (int l = 0; l < L; l++)
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                S[i][j][l] = A[0][i][l]*A[0][j][l] + A[1][i][l]*A[1][j][l] + A[2][i][l]*A[2][j][l];
+    for (int sweep = 0; sweep < JACOBI_SWEEPS; sweep++) {
+        JacobiConjugation<0, 1, 2>(S, V);
+        JacobiConjugation<0, 2, 1>(S, V);
+        JacobiConjugation<1, 2, 0>(S, V);
+    }
+
+    /* B = A V = U Sigma, columns sorted by decreasing singular value */
+    #pragma omp simd
+    for (int l = 0; l < L; l++) {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                B[i][j][l] = A[i][0][l]*V[0][j][l] + A[i][1][l]*V[1][j][l] + A[i][2][l]*V[2][j][l];
+        for (int j = 0; j < 3; j++)
+            n[j][l] = B[0][j][l]*B[0][j][l] + B[1][j][l]*B[1][j][l] + B[2][j][l]*B[2][j][l];
+    }
+    SortColumns<0, 1>(B, V, n);
+    SortColumns<0, 2>(B, V, n);
+    SortColumns<1, 2>(B, V, n);
+
+    /* QR decomposition B = U T, the Givens rotations accumulate X = G3 G2 G1 = U^T */
+    Givens<0, 1, 0>(B, X);
+    Givens<0, 2, 0>(B, X);
+    Givens<1, 2, 1>(B, X);
+
+    #pragma omp simd
+    for (int l = 0; l < L; l++)
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                R[i][j][l] = V[i][0][l]*X[0][j][l] + V[i][1][l]*X[1][j][l] + V[i][2][l]*X[2][j][l];
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef __SELECTION_H__
+#define __SELECTION_H__
+
+#include <vector>
+
+////////// class IndexSet //////////
+// set of vertex indices with constant time insert, erase and lookup: every
+// vertex knows its position in the member list, so erasing moves the last
+// member into the hole and iterating visits only the members
+class IndexSet {
+private:
+    std::vector<int> position;      // index into members, -1 for non-members
+    std::vector<int> members;
+public:
+    void Resize(int num_vertices) {
+        members.clear();
+        position.assign(num_vertices, -1);
+    }
+    bool Contains(int i) const { return position[i] >= 0; }
+    bool Insert(int i) {
+        if (Contains(i)) return false;
+        position[i] = (int)members.size();
+        members.push_back(i);
+        return true;
+    }
+    bool Erase(int i) {
+        if (!Contains(i)) return false;
+        int last = members.back();
+        members[position[i]] = last;
+        position[last] = position[i];
+        members.pop_back();
+        position[i] = -1;
+        return true;
+    }
+    void Clear() {
+        for (int i: members) position[i] = -1;
+        members.clear();
+    }
+
+    const std::vector<int> & Indices() const { return members; }
+    std::vector<int>::const_iterator begin() const { return members.begin(); }
+    std::vector<int>::const_iterator end() const { return members.end(); }
+    size_t size() const { return members.size(); }
+    bool empty() const { return members.empty(); }
+};
+
+////////// struct SelectionState //////////
+// what the user has picked in the viewer, in no particular order
+struct SelectionState {
+    IndexSet anchors;       // vertices passed to SetConstraints
+    IndexSet handles;       // anchors turned back into free vertices
+    IndexSet group;         // anchors moved together in dragging mode
+    IndexSet frontier;      // anchors added by the last 'a' or 'A', grown by the next 'A'
+
+    void Resize(int num_vertices) {
+        anchors.Resize(num_vertices);
+        handles.Resize(num_vertices);
+        group.Resize(num_vertices);
+        frontier.Resize(num_vertices);
+    }
+};
+
+#endif // __SELECTION_H__
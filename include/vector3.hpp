@@ -11,7 +11,6 @@
 
 #include <cmath>
 #include <iostream>
-using namespace std;
 
 // classes declaration
 template <class C> class Vector3;
@@ -111,7 +110,7 @@ public:
     friend Vector3<C> operator*(const C & l, const Vector3<C> & r) {
         return Vector3<C>(l*r[0], l*r[1], l*r[2]);
     }
-    friend ostream & operator<< (ostream & out, const Vector3<C> & r) {
+    friend std::ostream & operator<< (std::ostream & out, const Vector3<C> & r) {
         return out << r[0] << " " << r[1] << " " << r[2];
     }
 };
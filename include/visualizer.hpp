@@ -5,7 +5,13 @@
 #include "mesh.hpp"
 #include "matrix.hpp"
 #include "OpenGLProjector.hpp"
+#include "render_arrays.hpp"
+#include "bvh.hpp"
+#include "selection.hpp"
+#include <deque>
+#include <iostream>
 #include <queue>
+#include <vector>
 
 // Enumeration
 enum EnumDisplayMode { WIREFRAME, HIDDENLINE, FLATSHADED, SMOOTHSHADED, COLORSMOOTHSHADED };
@@ -21,6 +27,7 @@ int weight_type = UNIFORM;
 
 bool VIS_HANDLE = false;
 int ITER = 10;
+double TOLERANCE = 1e-4;
 
 // variables
 int displayMode = FLATSHADED;	// current display mode
@@ -38,13 +45,12 @@ Vector3d g_center;
 double g_sdepth;
 double drag_start_x = 0, drag_start_y = 0;
 Mesh mesh;	// our mesh
+RenderArrays arrays;    // vertex arrays the mesh is drawn from
+TriangleBVH bvh;        // faces of the mesh for picking by ray casting
 const double scale_factor = 0.1;
 
 // UI variables
-vector<int> anchor_indices;
-vector<int> handle_indices;
-vector<int> grouped_anchor_indices;
-vector<int> newly_added_anchor_indices;
+SelectionState selection;
 
 // functions
 void MoveAnchors(Vector3d);
@@ -188,40 +194,20 @@ void DisplayFunc() {
 
 // Wireframe render function
 void DrawWireframe() {
-    HEdgeList heList = mesh.Edges();
-    HEdgeList bheList = mesh.BoundaryEdges();
+    arrays.Update(mesh);
     glColor3f(1.0, 1.0, 1.0);
-    glBegin(GL_LINES);
-    size_t i;
-    for (i=0; i<heList.size(); i++) {
-        glVertex3dv(heList[i]->Start()->Position().ToArray());
-        glVertex3dv(heList[i]->End()->Position().ToArray());
-    }
+    arrays.DrawLines(arrays.lines);
     glColor3f(1, 0, 0);
-    for (i=0; i<bheList.size(); i++) {
-        glVertex3dv(bheList[i]->Start()->Position().ToArray());
-        glVertex3dv(bheList[i]->End()->Position().ToArray());
-    }
-    glEnd();
+    arrays.DrawLines(arrays.boundary_lines);
 }
 
 // Hidden Line render function
 void DrawHiddenLine() {
-    FaceList fList = mesh.Faces();
+    arrays.Update(mesh);
     glShadeModel(GL_FLAT);
     glEnable(GL_POLYGON_OFFSET_FILL);
     glColor3f(0, 0, 0);
-    glBegin(GL_TRIANGLES);
-    for (size_t i=0; i<fList.size(); i++) {
-        Face *f = fList[i];
-        const Vector3d & pos1 = f->HalfEdge()->Start()->Position();
-        const Vector3d & pos2 = f->HalfEdge()->End()->Position();
-        const Vector3d & pos3 = f->HalfEdge()->Next()->End()->Position();
-        glVertex3dv(pos1.ToArray());
-        glVertex3dv(pos2.ToArray());
-        glVertex3dv(pos3.ToArray());
-    }
-    glEnd();
+    arrays.DrawTriangles();
     glDisable(GL_POLYGON_OFFSET_FILL);
 
     DrawWireframe();
@@ -229,79 +215,37 @@ void DrawHiddenLine() {
 
 // Flat Shaded render function
 void DrawFlatShaded() {
-    FaceList fList = mesh.Faces();
+    arrays.UpdateFlat(mesh);
     glShadeModel(GL_FLAT);
     glEnable(GL_LIGHTING);
     glColor3f(0.4f, 0.4f, 1.0f);
-    glBegin(GL_TRIANGLES) ;
-    for (size_t i=0; i<fList.size(); i++) {
-        Face *f = fList[i];
-        const Vector3d & pos1 = f->HalfEdge()->Start()->Position();
-        const Vector3d & pos2 = f->HalfEdge()->End()->Position();
-        const Vector3d & pos3 = f->HalfEdge()->Next()->End()->Position();
-        Vector3d normal = (pos2-pos1).Cross(pos3-pos1);
-        normal /= normal.L2Norm();
-        glNormal3dv(normal.ToArray());
-        glVertex3dv(pos1.ToArray());
-        glVertex3dv(pos2.ToArray());
-        glVertex3dv(pos3.ToArray());
-    }
-    glEnd();
+    arrays.DrawFlatTriangles();
     glDisable(GL_LIGHTING);
 }
 
 // Smooth Shaded render function
 void DrawSmoothShaded() {
-    FaceList fList = mesh.Faces();
+    arrays.Update(mesh);
     glShadeModel(GL_SMOOTH);
     glEnable(GL_LIGHTING);
     glColor3f(0.4f, 0.4f, 1.0f);
-    glBegin(GL_TRIANGLES) ;
-    for (size_t i=0; i<fList.size(); i++) {
-        Face *f = fList[i];
-        Vertex * v1 = f->HalfEdge()->Start();
-        Vertex * v2 = f->HalfEdge()->End();
-        Vertex * v3 = f->HalfEdge()->Next()->End();
-        glNormal3dv(v1->Normal().ToArray());
-        glVertex3dv(v1->Position().ToArray());
-        glNormal3dv(v2->Normal().ToArray());
-        glVertex3dv(v2->Position().ToArray());
-        glNormal3dv(v3->Normal().ToArray());
-        glVertex3dv(v3->Position().ToArray());
-    }
-    glEnd();
+    arrays.DrawSmoothTriangles(false);
     glDisable(GL_LIGHTING);
 }
 
 // Color Smooth Shaded render function
 void DrawColorSmoothShaded() {
-    FaceList fList = mesh.Faces();
+    arrays.Update(mesh);
     glShadeModel(GL_SMOOTH);
     glEnable(GL_LIGHTING);
     glColor3f(0.4f, 0.4f, 1.0f);
-    glBegin(GL_TRIANGLES) ;
-    for (size_t i=0; i<fList.size(); i++) {
-        Face *f = fList[i];
-        Vertex * v1 = f->HalfEdge()->Start();
-        Vertex * v2 = f->HalfEdge()->End();
-        Vertex * v3 = f->HalfEdge()->Next()->End();
-        glNormal3dv(v1->Normal().ToArray());
-        glColor3dv(v1->Color().ToArray());
-        glVertex3dv(v1->Position().ToArray());
-        glNormal3dv(v2->Normal().ToArray());
-        glColor3dv(v2->Color().ToArray());
-        glVertex3dv(v2->Position().ToArray());
-        glNormal3dv(v3->Normal().ToArray());
-        glColor3dv(v3->Color().ToArray());
-        glVertex3dv(v3->Position().ToArray());
-    }
-    glEnd();
+    arrays.DrawSmoothTriangles(true);
     glDisable(GL_LIGHTING);
 }
 
 // draw the selected ROI vertices on the mesh
 void DrawSelectedVertices() {
-    VertexList vList = mesh.Vertices();
+    VertexSpan vList = mesh.Vertices();
     glColor3f(1.0, 0.0, 0.0);
     glPointSize(5.0);
     glBegin(GL_POINTS);
@@ -318,8 +262,7 @@ void DrawSelectedVertices() {
         }
     } else {
         for (i = 0; i < vList.size(); i++) {
-            vector<int>::iterator iter = find(grouped_anchor_indices.begin(), grouped_anchor_indices.end(), i);
-            if (iter != grouped_anchor_indices.end()) glColor3f(0.8, 0.0, 0.0); // Groupped Anchor Point
+            if (selection.group.Contains((int)i)) glColor3f(0.8, 0.0, 0.0); // Groupped Anchor Point
             else if (vList[i]->Type() == ANCHOR || vList[i]->Type() == STATIONARY) glColor3f(0.0, 0.0, 1.0); // Anchor Point
             else if (vList[i]->Type() == HANDLE) { // Handle Point
                 if (VIS_HANDLE == 1) glColor3f(1.0, 1.0, 1.0); 
@@ -333,9 +276,9 @@ void DrawSelectedVertices() {
 
 // Drag a group of anchors
 void MoveAnchors(Vector3d shift) {
-    for (int idx: grouped_anchor_indices) {
-        Vector3d pos = mesh.Vertices()[idx]->Position();
-        mesh.Vertices()[idx]->SetPosition( pos + shift );
+    for (int idx: selection.group) {
+        Vertex *v = mesh.Vertices()[idx];
+        v->SetPosition( v->Position() + shift );
     }
 }
 
@@ -346,23 +289,23 @@ void KeyboardFunc(unsigned char ch, int x, int y) {
     switch (ch) {
         case '1':	// key '1'
             currentMode = Viewing;
-            cout << "Viewing mode" << endl;
+            std::cout << "Viewing mode" << std::endl;
             break;
         case '2':	// key '2'
             currentMode = Selection;
-            cout << "Selection mode" << endl;
+            std::cout << "Selection mode" << std::endl;
             break;
         case '3':   // key '3'
             currentMode = Dragging;
-            cout << "Dragging mode" << endl;
+            std::cout << "Dragging mode" << std::endl;
             break;
         case 'a':   // Pick one anchor point
             if (currentMode == Selection && currSelectedVertex != -1) {
                 if (mesh.Vertices()[currSelectedVertex]->Type() != HANDLE) {
                     mesh.Vertices()[currSelectedVertex]->SetFlag(0);
-                    grouped_anchor_indices.clear();
-                    grouped_anchor_indices.emplace_back(currSelectedVertex);
-                    deque<int> queue;
+                    selection.group.Clear();
+                    selection.group.Insert(currSelectedVertex);
+                    std::deque<int> queue;
                     queue.push_back(currSelectedVertex);
                     while ( queue.size() != 0 ) {
                         OneRingVertex ring(mesh.Vertices()[queue.front()]);
@@ -371,21 +314,17 @@ void KeyboardFunc(unsigned char ch, int x, int y) {
                         while ( curr_neighbor = ring.NextVertex() ) {
                             if (curr_neighbor->Type() != HANDLE) {
                                 int idx = curr_neighbor->Index();
-                                vector<int>::iterator iter = find(grouped_anchor_indices.begin(), grouped_anchor_indices.end(), idx);
-                                if (iter == grouped_anchor_indices.end()) {
-                                    queue.push_back(idx);
-                                    grouped_anchor_indices.emplace_back(idx);
-                                }
+                                if (selection.group.Insert(idx)) queue.push_back(idx);
                             }
                         }
                     }
                 } else {
-                    anchor_indices.emplace_back(currSelectedVertex);
-                    handle_indices.erase(remove(handle_indices.begin(), handle_indices.end(), currSelectedVertex), handle_indices.end());
-                    grouped_anchor_indices.clear();
-                    grouped_anchor_indices.emplace_back(currSelectedVertex);
-                    newly_added_anchor_indices.clear();
-                    newly_added_anchor_indices.emplace_back(currSelectedVertex);
+                    selection.anchors.Insert(currSelectedVertex);
+                    selection.handles.Erase(currSelectedVertex);
+                    selection.group.Clear();
+                    selection.group.Insert(currSelectedVertex);
+                    selection.frontier.Clear();
+                    selection.frontier.Insert(currSelectedVertex);
                     mesh.Vertices()[currSelectedVertex]->SetFlag(0);
                     mesh.Vertices()[currSelectedVertex]->SetType(ANCHOR);
                 }
@@ -393,9 +332,9 @@ void KeyboardFunc(unsigned char ch, int x, int y) {
             break;
         case 'A':   // Extend a group of neighboring anchor points
             if (currentMode == Selection && currSelectedVertex != -1) {
-                vector<int> iterated_list = newly_added_anchor_indices;
-                newly_added_anchor_indices.clear();
-                
+                std::vector<int> iterated_list = selection.frontier.Indices();
+                selection.frontier.Clear();
+
                 for (int idx: iterated_list) {
                     OneRingVertex ring(mesh.Vertices()[idx]);
                     Vertex *curr_neighbor = NULL;
@@ -403,10 +342,10 @@ void KeyboardFunc(unsigned char ch, int x, int y) {
                         if (curr_neighbor->Type() == HANDLE) {
                             curr_neighbor->SetFlag(0);
                             curr_neighbor->SetType(ANCHOR);
-                            anchor_indices.emplace_back(curr_neighbor->Index());
-                            handle_indices.erase(remove(handle_indices.begin(), handle_indices.end(), curr_neighbor->Index()), handle_indices.end());
-                            grouped_anchor_indices.emplace_back(curr_neighbor->Index());
-                            newly_added_anchor_indices.emplace_back(curr_neighbor->Index());
+                            selection.anchors.Insert(curr_neighbor->Index());
+                            selection.handles.Erase(curr_neighbor->Index());
+                            selection.group.Insert(curr_neighbor->Index());
+                            selection.frontier.Insert(curr_neighbor->Index());
                         }
                     }
                 }
@@ -415,10 +354,10 @@ void KeyboardFunc(unsigned char ch, int x, int y) {
         case 'h':
         case 'H':   // Change anchor to handle
             if (currentMode == Selection && currSelectedVertex != -1) {
-                handle_indices.emplace_back(currSelectedVertex);
-                anchor_indices.erase(remove(anchor_indices.begin(), anchor_indices.end(), currSelectedVertex), anchor_indices.end());
-                grouped_anchor_indices.clear();
-                newly_added_anchor_indices.clear();
+                selection.handles.Insert(currSelectedVertex);
+                selection.anchors.Erase(currSelectedVertex);
+                selection.group.Clear();
+                selection.frontier.Clear();
                 mesh.Vertices()[currSelectedVertex]->SetFlag(0);
                 mesh.Vertices()[currSelectedVertex]->SetType(HANDLE);
             }
@@ -462,13 +401,25 @@ void KeyboardFunc(unsigned char ch, int x, int y) {
             break;
         case '4':
         deform:
-            cout << "Deforming the mesh" << endl;
-            mesh.SetConstraints(anchor_indices);
-            cout<<anchor_indices.size()<<" "<<handle_indices.size()<<endl;
-            mesh.Deform(ITER, static_cast<WEIGHT_TYPE>(weight_type));
+            std::cout << "Deforming the mesh" << std::endl;
+            mesh.SetConstraints(selection.anchors.Indices());
+            std::cout<<selection.anchors.size()<<" "<<selection.handles.size()<<std::endl;
+            {
+                DeformOptions options;
+                options.max_iterations = ITER;
+                options.tolerance = TOLERANCE;
+                DeformStats stats = mesh.Deform(options, static_cast<WEIGHT_TYPE>(weight_type));
+                std::cout << stats.iterations << " iterations, energy " << stats.energies.back()
+                     << (stats.converged ? " (converged)" : "") << std::endl;
+            }
+            std::cout << mesh.factorization_counter << std::endl;
+#ifdef ARAP_PROFILE
+            std::cout << mesh.profile << std::endl;
+            mesh.profile.Reset();
+#endif
             break;
          case 'r':
-             cout << "The picked point's index is " << currSelectedVertex << ".\n";
+             std::cout << "The picked point's index is " << currSelectedVertex << ".\n";
              break;
     }
     glutPostRedisplay();
@@ -509,8 +460,8 @@ void MouseFunc(int button, int state, int x, int y) {
             drag_start_y = y;
         }
         if(leftUp){
-            cout<<"start: "<<drag_start_x<<" "<<drag_start_y<<endl;
-            cout<<"end: "<<lastX<<" "<<lastY<<endl;
+            std::cout<<"start: "<<drag_start_x<<" "<<drag_start_y<<std::endl;
+            std::cout<<"end: "<<lastX<<" "<<lastY<<std::endl;
             auto start = unproject(drag_start_x, drag_start_y);
             auto end = unproject(lastX, lastY);
             auto shiftVec = end - start;
@@ -539,51 +490,30 @@ void MotionFunc(int x, int y) {
 }
 
 
-// select a mesh point
+// select the mesh point nearest to where the ray through the mouse position enters the mesh
 void SelectVertexByPoint()
 {
-    // get the selection position
+    // get the selection ray, from the near to the far plane
     int x = lastX, y = winHeight - lastY;
-    Vector3d u(x,y,0);
-
     OpenGLProjector projector;
+    Vector3d near_point = projector.UnProject(x, y, 0);
+    Vector3d far_point = projector.UnProject(x, y, 1);
+    Eigen::Vector3d origin(near_point.X(), near_point.Y(), near_point.Z());
+    Eigen::Vector3d direction(far_point.X() - near_point.X(), far_point.Y() - near_point.Y(), far_point.Z() - near_point.Z());
 
-    VertexList vList = mesh.Vertices();
-
-    double mindis = 1e6; int selectedIndex = -1;
-    for (size_t i=0; i<vList.size(); i++)
-    {
-        Vector3d v = projector.Project(vList[i]->Position());
-
-        vList[i]->SetFlag(0); // set back to unselected
-
-        if (projector.GetDepthValue((int)v.X(), (int)v.Y()) - v.Z() <= -1e-4)
-        {
-            continue;
-        }
-        v.Z() = 0;
-
-        double dist = (u - v).L2Norm();
-        if (dist < mindis)
-        {
-            mindis = dist;
-            selectedIndex = (int)i;
-        }
-    }
-
-    if (selectedIndex != -1)
-    {
-        currSelectedVertex = selectedIndex;
-        vList[selectedIndex]->SetFlag(1);
-    }
+    if (currSelectedVertex != -1) mesh.Vertices()[currSelectedVertex]->SetFlag(0); // set back to unselected
 
+    bvh.Update(mesh);
+    currSelectedVertex = bvh.PickVertex(mesh, origin, direction);
+    if (currSelectedVertex != -1) mesh.Vertices()[currSelectedVertex]->SetFlag(1);
 }
 
 void InitAnchorList(){
+    selection.Resize((int)mesh.vList.size());
     for(auto v: mesh.vList){
         if(v->Type() == ANCHOR){
-            anchor_indices.push_back(v->Index());
-            grouped_anchor_indices.push_back(v->Index());
+            selection.anchors.Insert(v->Index());
+            selection.group.Insert(v->Index());
         }
     }
 }
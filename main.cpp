@@ -1,5 +1,7 @@
 #include "visualizer.hpp"
 
+using namespace std;
+
 // main function
 int main(int argc, char **argv) {
     glutInit(&argc, argv);
@@ -1,14 +1,27 @@
 #include "mesh.hpp"
 #include "matrix.hpp"
+#include "rotation.hpp"
+#include "mapped_file.hpp"
+#include "mesh_cache.hpp"
+#include <cstdio>
 #include <cstring>
 #include <iostream>
-#include <strstream>
 #include <fstream>
+#include <sstream>
+#include <charconv>
 #include <cmath>
 #include <float.h>
 #include <assert.h>
 #include <queue>
 #include <list>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define PI 3.1415926535
 
@@ -35,167 +48,419 @@ inline double Area(const Vector3d & p1, const Vector3d & p2, const Vector3d & p3
 
 
 /////////////////////////////////////////
-// implementation of OneRingHEdge class
-OneRingHEdge::OneRingHEdge(const Vertex * v) {
-    if (v == NULL) start = next = NULL;
-    else start = next = v->HalfEdge();
-}
+// implementation of Mesh class
+//
+// function BuildElements
+// fills the pools with the vertices of p and the faces of faces with their
+// interior half edges, half edge 3f+k of face f starts at faces(k,f).
+// twins are left unset
+void Mesh::BuildElements() {
+    int n = (int)p.cols();
+    int m = (int)faces.cols();
+
+    v_pool.Grow(n);
 
-HEdge * OneRingHEdge::NextHEdge() {
-    HEdge *ret = next;
-    if (next && next->Prev()->Twin() != start)
-        next = next->Prev()->Twin();
-    else
-        next = NULL;
-    return ret;
+    f_pool.Grow(m);
+    he_pool.Grow(3 * m, false);
+    for (int f = 0; f < m; f++) {
+        for (int k = 0; k < 3; k++) {
+            int e = 3*f + k;
+            he_pool.next[e] = 3*f + (k+1)%3;
+            he_pool.prev[e] = 3*f + (k+2)%3;
+            he_pool.start[e] = faces(k,f);
+            he_pool.face[e] = f;
+            v_pool.he[faces(k,f)] = e;
+        }
+        f_pool.he[f] = 3*f + 2;
+    }
 }
 
-/////////////////////////////////////////
-// implementation of Mesh class
-//
-// function AddFace
-// it's only for loading obj model, you do not need to understand it
-void Mesh::AddFace(int v1, int v2, int v3) {
-    int i;
-    HEdge *he[3], *bhe[3];
-    Vertex *v[3];
-    Face *f;
-
-    // obtain objects
-    for (i=0; i<3; i++) he[i] = new HEdge();
-    for (i=0; i<3; i++) bhe[i] = new HEdge(true);
-    v[0] = vList[v1];
-    v[1] = vList[v2];
-    v[2] = vList[v3];
-    f = new Face();
-
-    // connect prev-next pointers
-    SetPrevNext(he[0], he[1]);
-    SetPrevNext(he[1], he[2]);
-    SetPrevNext(he[2], he[0]);
-    SetPrevNext(bhe[0], bhe[1]);
-    SetPrevNext(bhe[1], bhe[2]);
-    SetPrevNext(bhe[2], bhe[0]);
-
-    // connect twin pointers
-    SetTwin(he[0], bhe[0]);
-    SetTwin(he[1], bhe[2]);
-    SetTwin(he[2], bhe[1]);
-
-    // connect start pointers for bhe
-    bhe[0]->SetStart(v[1]);
-    bhe[1]->SetStart(v[0]);
-    bhe[2]->SetStart(v[2]);
-    for (i=0; i<3; i++) he[i]->SetStart(v[i]);
-
-    // connect start pointers
-    // connect face-hedge pointers
-    for (i=0; i<3; i++) {
-        v[i]->SetHalfEdge(he[i]);
-        v[i]->adjHEdges.push_back(he[i]);
-        SetFace(f, he[i]);
-    }
-    v[0]->adjHEdges.push_back(bhe[1]);
-    v[1]->adjHEdges.push_back(bhe[0]);
-    v[2]->adjHEdges.push_back(bhe[2]);
-
-    // merge boundary if in need
-    for (i=0; i<3; i++) {
-        Vertex *start = bhe[i]->Start();
-        Vertex *end   = bhe[i]->End();
-        for (size_t j=0; j<end->adjHEdges.size(); j++) {
-            HEdge *curr = end->adjHEdges[j];
-            if (curr->IsBoundary() && curr->End()==start) {
-                SetPrevNext(bhe[i]->Prev(), curr->Next());
-                SetPrevNext(curr->Prev(), bhe[i]->Next());
-                SetTwin(bhe[i]->Twin(), curr->Twin());
-                bhe[i]->SetStart(NULL);	// mark as unused
-                curr->SetStart(NULL);	// mark as unused
+// function BuildConnectivity
+// builds the half edge structure of the triangles in faces in linear time:
+// twins are found by bucketing the half edges by start vertex, boundary half
+// edges are linked through the boundary half edge leaving each vertex
+void Mesh::BuildConnectivity() {
+    int n = (int)p.cols();
+    int m = (int)faces.cols();
+    this->BuildElements();
+    vector<int> &twin = he_pool.twin, &start = he_pool.start;
+    auto end = [&](int e) { return start[he_pool.next[e]]; };
+
+    /* half edges bucketed by their start vertex, the twin of a->b is b->a in the bucket of b */
+    vector<int> first(n + 1, 0), outgoing(3 * m);
+    for (int e = 0; e < 3 * m; e++) first[start[e] + 1]++;
+    for (int i = 0; i < n; i++) first[i + 1] += first[i];
+    vector<int> fill(first.begin(), first.end() - 1);
+    for (int e = 0; e < 3 * m; e++) outgoing[fill[start[e]]++] = e;
+    for (int e = 0; e < 3 * m; e++) {
+        if (twin[e] >= 0) continue;
+        int b = end(e);
+        for (int k = first[b]; k < first[b + 1]; k++) {
+            int o = outgoing[k];
+            if (end(o) == start[e] && o != e && twin[o] < 0) {
+                twin[e] = o;
+                twin[o] = e;
                 break;
             }
         }
     }
 
-    // finally add hedges and faces to list
-    for (i=0; i<3; i++) heList.push_back(he[i]);
-    for (i=0; i<3; i++) bheList.push_back(bhe[i]);
-    fList.push_back(f);
+    /* the remaining half edges get a boundary twin running the other way */
+    int num_boundary = 0;
+    for (int e = 0; e < 3 * m; e++) num_boundary += twin[e] < 0;
+    he_pool.Grow(num_boundary, true);
+    vector<int> boundary_out(n, -1);
+    for (int e = 0, b = 3 * m; e < 3 * m; e++) {
+        if (twin[e] >= 0) continue;
+        twin[e] = b;
+        twin[b] = e;
+        start[b] = end(e);
+        boundary_out[start[b]] = b;
+        b++;
+    }
+    for (int b = 3 * m; b < he_pool.Size(); b++) {
+        int next = boundary_out[start[twin[b]]];
+        if (next < 0) continue;
+        he_pool.next[b] = next;
+        he_pool.prev[next] = b;
+    }
+
+    this->BuildHandles();
+}
+
+// function BuildHandles
+// creates one handle per pool element and the lists pointing to them
+void Mesh::BuildHandles() {
+    int num_hedges = he_pool.Size(), num_interior = 3 * f_pool.Size();
+    he_handles.clear();
+    v_handles.clear();
+    f_handles.clear();
+    he_handles.reserve(num_hedges);
+    v_handles.reserve(v_pool.Size());
+    f_handles.reserve(f_pool.Size());
+    for (int i = 0; i < num_hedges; i++) he_handles.emplace_back(this, i);
+    for (int i = 0; i < v_pool.Size(); i++) v_handles.emplace_back(this, i);
+    for (int i = 0; i < f_pool.Size(); i++) f_handles.emplace_back(this, i);
+
+    heList.resize(num_interior);
+    bheList.resize(num_hedges - num_interior);
+    vList.resize(v_handles.size());
+    fList.resize(f_handles.size());
+    for (int i = 0; i < num_interior; i++) heList[i] = &he_handles[i];
+    for (int i = num_interior; i < num_hedges; i++) bheList[i - num_interior] = &he_handles[i];
+    for (size_t i = 0; i < vList.size(); i++) vList[i] = &v_handles[i];
+    for (size_t i = 0; i < fList.size(); i++) fList[i] = &f_handles[i];
+}
+
+/* helpers of LoadObjFile, they advance the cursor past what they read */
+static inline void SkipSpaces(const char *&c, const char *end) {
+    while (c < end && (*c == ' ' || *c == '\t' || *c == '\r')) c++;
+}
+
+static inline void SkipLine(const char *&c, const char *end) {
+    const char *eol = (const char *)memchr(c, '\n', end - c);
+    c = eol ? eol + 1 : end;
+}
+
+static inline bool ParseDouble(const char *&c, const char *end, double &value) {
+    SkipSpaces(c, end);
+    if (c < end && *c == '+') c++;      // from_chars does not take a leading '+'
+    auto result = from_chars(c, end, value);
+    if (result.ec != errc()) return false;
+    c = result.ptr;
+    return true;
+}
+
+/* vertex reference of a face, "v", "v/vt", "v//vn" or "v/vt/vn", returns the 0-based position index */
+static inline bool ParseIndex(const char *&c, const char *end, int num_vertices, int &index) {
+    SkipSpaces(c, end);
+    auto result = from_chars(c, end, index);
+    if (result.ec != errc()) return false;
+    c = result.ptr;
+    while (c < end && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n') c++;
+    index = index < 0 ? num_vertices + index : index - 1;
+    return true;
+}
+
+/* vertices and triangles of an obj file, false if a face refers to a missing vertex */
+static bool ParseObj(const MappedFile &file, vector<double> &coordinates, vector<int> &triangles) {
+    vector<int> polygon;
+    const char *c = file.Data(), *end = file.End();
+    while (c < end) {
+        SkipSpaces(c, end);
+        if (c + 1 < end && (c[1] == ' ' || c[1] == '\t')) {
+            c++;
+            // vertex
+            if (c[-1] == 'v') {
+                double x = 0, y = 0, z = 0;
+                ParseDouble(c, end, x) && ParseDouble(c, end, y) && ParseDouble(c, end, z);
+                coordinates.push_back(x);
+                coordinates.push_back(y);
+                coordinates.push_back(z);
+            }
+            // face
+            else if (c[-1] == 'f') {
+                int num_vertices = (int)coordinates.size() / 3;
+                int index;
+                polygon.clear();
+                while (ParseIndex(c, end, num_vertices, index)) {
+                    if (index < 0 || index >= num_vertices) return false;
+                    polygon.push_back(index);
+                }
+                for (size_t k = 2; k < polygon.size(); k++) {
+                    triangles.push_back(polygon[0]);
+                    triangles.push_back(polygon[k-1]);
+                    triangles.push_back(polygon[k]);
+                }
+            }
+        }
+        SkipLine(c, end);
+    }
+    return true;
 }
 
 // function LoadObjFile
-// it's only for loading obj model, you do not need to understand it
+// reads the vertices and faces of an obj model, polygons are split into triangle fans.
+// a matching <obj>.cache is read instead of the text if read_mesh_cache is set
 bool Mesh::LoadObjFile(const char *filename) {
     if (filename==NULL || strlen(filename)==0) return false;
-    ifstream ifs(filename);
-    if (ifs.fail()) return false;
+    MappedFile file(filename);
+    if (!file.IsOpen()) return false;
+
+    string cache_path = string(filename) + ".cache";
+    if (!read_mesh_cache || !this->LoadMeshCache(cache_path.c_str(), file)) {
+        vector<double> coordinates;
+        vector<int> triangles;
+        if (!ParseObj(file, coordinates, triangles)) return false;
+
+        Clear();
+        p = Eigen::Map<Eigen::Matrix<double, 3, Eigen::Dynamic>>(coordinates.data(), 3, coordinates.size() / 3);
+        faces = Eigen::Map<Eigen::Matrix<int, 3, Eigen::Dynamic>>(triangles.data(), 3, triangles.size() / 3);
+        this->BuildConnectivity();
+        this->BuildAdjacency();
+        cotangent_weights.clear();
+        if (write_mesh_cache) this->SaveMeshCache(cache_path.c_str(), file);
+    }
+
+    p_prime = p;
+    topology_version++;
+    vertex_version++;
+    rotations.clear();
+    signature.valid = false;
+    constraint_update.Clear();
+    this->ResetConstraints();
+
+    return true;
+}
+
+// function LoadMeshCache
+// replaces the mesh by the cache if it was written for the given obj file,
+// otherwise returns false and leaves the mesh untouched. the arrays are read
+// from the mapping and copied into the pools, the mapping is released on return
+bool Mesh::LoadMeshCache(const char *cache_path, const MappedFile &source) {
+    MappedFile cache(cache_path);
+    if (!cache.IsOpen() || cache.Size() < sizeof(MeshCacheHeader)) return false;
+    MeshCacheHeader header;
+    memcpy(&header, cache.Data(), sizeof(header));
+    if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0) return false;
+    if (header.version != MESH_CACHE_VERSION || header.source_size != source.Size()) return false;
+    if (header.num_vertices < 0 || header.num_faces < 0 || header.num_boundary < 0 || header.num_edges < 0) return false;
+
+    size_t n = header.num_vertices, m = header.num_faces, nb = header.num_boundary, ne = header.num_edges;
+    bool has_weights = header.flags & MESH_CACHE_COTANGENT;
+    size_t expected = MeshCachePadded(sizeof(header)) + MeshCachePadded(3 * n * sizeof(double))
+                    + 2 * MeshCachePadded(3 * m * sizeof(int32_t)) + MeshCachePadded(nb * sizeof(int32_t))
+                    + MeshCachePadded((n + 1) * sizeof(int32_t)) + 2 * MeshCachePadded(ne * sizeof(int32_t))
+                    + (has_weights ? MeshCachePadded(ne * sizeof(double)) : 0);
+    if (cache.Size() != expected) return false;
+    if (header.source_hash != MeshCacheHash(source.Data(), source.Size())) return false;
+
+    /* the arrays follow the header in the order of mesh_cache.hpp, they are
+     * validated where they are mapped and copied once they are known to be sane */
+    const char *cursor = cache.Data() + MeshCachePadded(sizeof(header));
+    auto next = [&](size_t bytes) { const char *at = cursor; cursor += MeshCachePadded(bytes); return at; };
+    const double  *positions     = (const double *)next(3 * n * sizeof(double));
+    const int32_t *face_indices  = (const int32_t *)next(3 * m * sizeof(int32_t));
+    const int32_t *twins         = (const int32_t *)next(3 * m * sizeof(int32_t));
+    const int32_t *boundary_next = (const int32_t *)next(nb * sizeof(int32_t));
+    const int32_t *offsets       = (const int32_t *)next((n + 1) * sizeof(int32_t));
+    const int32_t *neighbors     = (const int32_t *)next(ne * sizeof(int32_t));
+    const int32_t *reverse       = (const int32_t *)next(ne * sizeof(int32_t));
+    const double  *weights       = has_weights ? (const double *)next(ne * sizeof(double)) : NULL;
+
+    /* reject indices that would point outside the mesh */
+    for (size_t i = 0; i < 3 * m; i++)
+        if (face_indices[i] < 0 || face_indices[i] >= (int)n || twins[i] >= (int)(3 * m) || twins[i] < -(int)nb) return false;
+    for (size_t i = 0; i < nb; i++)
+        if (boundary_next[i] < 0 || boundary_next[i] >= (int)nb) return false;
+    if (offsets[0] != 0 || offsets[n] != (int)ne) return false;
+    for (size_t i = 0; i < ne; i++)
+        if (neighbors[i] < 0 || neighbors[i] >= (int)n || reverse[i] < -1 || reverse[i] >= (int)ne) return false;
+
     Clear();
-    vector<double> vertex_x, vertex_y, vertex_z;
-    vector<int> face_idx1, face_idx2, face_idx3;
-
-    char buf[1024], type[1024];
-    do {
-        ifs.getline(buf, 1024);
-        istrstream iss(buf);
-        memset(type, '\0', sizeof(type));
-        iss >> type;
-
-        // vertex
-        if (strcmp(type, "v") == 0) {
-            double x, y, z;
-            iss >> x >> y >> z;
-            AddVertex(new Vertex(x,y,z));
-            vertex_x.push_back(x);
-            vertex_y.push_back(y);
-            vertex_z.push_back(z);
+    p = Eigen::Map<const Eigen::Matrix<double, 3, Eigen::Dynamic>>(positions, 3, n);
+    faces = Eigen::Map<const Eigen::Matrix<int, 3, Eigen::Dynamic>>(face_indices, 3, m);
+    this->BuildElements();
+
+    /* boundary half edge b of the cache is 3m+b in the pool */
+    he_pool.Grow((int)nb, true);
+    for (size_t e = 0; e < 3 * m; e++) {
+        if (twins[e] >= 0) he_pool.twin[e] = twins[e];
+        else {
+            int b = (int)(3 * m) - 1 - twins[e];
+            he_pool.twin[e] = b;
+            he_pool.twin[b] = (int)e;
+            he_pool.start[b] = he_pool.start[he_pool.next[e]];
         }
-            // face
-        else if (strcmp(type, "f") == 0) {
-            int index[3];
-            iss >> index[0] >> index[1] >> index[2];
-            AddFace(index[0]-1, index[1]-1, index[2]-1);
-            face_idx1.push_back(index[0]-1);
-            face_idx2.push_back(index[1]-1);
-            face_idx3.push_back(index[2]-1);
-        }
-    } while (!ifs.eof());
-    ifs.close();
-
-    size_t i;
-//    Vector3d box = this->MaxCoord() - this->MinCoord();
-//    for (i=0; i<vList.size(); i++) vList[i]->SetPosition(vList[i]->Position() / box.X());
-//
-//    Vector3d tot;
-//    for (i=0; i<vList.size(); i++) tot += vList[i]->Position();
-//    Vector3d avg = tot / vList.size();
-//    for (i=0; i<vList.size(); i++) vList[i]->SetPosition(vList[i]->Position() - avg);
+    }
+    for (size_t b = 0; b < nb; b++) {
+        int next = (int)(3 * m) + boundary_next[b];
+        he_pool.next[3 * m + b] = next;
+        he_pool.prev[next] = (int)(3 * m + b);
+    }
+    this->BuildHandles();
 
-    HEdgeList list;
-    for (i=0; i<bheList.size(); i++)
-        if (bheList[i]->Start()) list.push_back(bheList[i]);
-    bheList = list;
+    adjacency.offsets.assign(offsets, offsets + n + 1);
+    adjacency.neighbors.assign(neighbors, neighbors + ne);
+    adjacency.reverse.assign(reverse, reverse + ne);
+    adjacency.weights.assign(ne, 0.0);
+    if (weights) cotangent_weights.assign(weights, weights + ne);
+    else cotangent_weights.clear();
+    return true;
+}
 
-    for (i=0; i<vList.size(); i++)
-    {
-        vList[i]->adjHEdges.clear();
-        vList[i]->SetIndex((int)i);
-        vList[i]->SetFlag(0);
+// function SaveMeshCache
+// writes the loaded mesh as the cache of the given obj file, through a
+// temporary file so that concurrent readers never see a partial cache
+bool Mesh::SaveMeshCache(const char *cache_path, const MappedFile &source) {
+    size_t n = vList.size(), m = fList.size(), nb = bheList.size(), ne = adjacency.neighbors.size();
+    if (cache_weights && cotangent_weights.empty()) {
+        vector<double> weights = adjacency.weights;
+        this->InitWeights(COTANGENT);
+        cotangent_weights.swap(adjacency.weights);
+        adjacency.weights.swap(weights);
     }
 
-    p.resize(3, vList.size());
-    faces.resize(3, fList.size());
-    for(int i = 0; i < vList.size(); i++){
-        p(0,i) = vertex_x[i];
-        p(1,i) = vertex_y[i];
-        p(2,i) = vertex_z[i];
+    /* boundary half edges are stored as -1-b, counted from the first boundary half edge */
+    vector<int32_t> twins(3 * m), boundary_next(nb);
+    for (size_t e = 0; e < 3 * m; e++) {
+        int twin = he_pool.twin[e];
+        twins[e] = twin < (int)(3 * m) ? twin : (int)(3 * m) - 1 - twin;
     }
-    for(int i = 0; i < fList.size(); i++){
-        faces(0,i) = face_idx1[i];
-        faces(1,i) = face_idx2[i];
-        faces(2,i) = face_idx3[i];
+    for (size_t b = 0; b < nb; b++) boundary_next[b] = he_pool.next[3 * m + b] - (int)(3 * m);
+
+    MeshCacheHeader header;
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.flags = cache_weights ? MESH_CACHE_COTANGENT : 0;
+    header.source_size = source.Size();
+    header.source_hash = MeshCacheHash(source.Data(), source.Size());
+    header.num_vertices = (int32_t)n;
+    header.num_faces = (int32_t)m;
+    header.num_boundary = (int32_t)nb;
+    header.num_edges = (int32_t)ne;
+
+    /* Concurrent writers of the same cache, e.g. parallel manifest jobs, each get
+     * their own temporary file, so only complete caches are renamed into place */
+    ostringstream unique;
+    unique << cache_path << ".tmp." << getpid() << "." << hash<thread::id>()(this_thread::get_id());
+    string temporary = unique.str();
+    ofstream ofs(temporary, ios::binary);
+    if (ofs.fail()) return false;
+    auto write = [&](const void *data, size_t bytes) {
+        static const char padding[8] = {0};
+        ofs.write((const char *)data, bytes);
+        ofs.write(padding, MeshCachePadded(bytes) - bytes);
+    };
+    write(&header, sizeof(header));
+    write(p.data(), 3 * n * sizeof(double));
+    write(faces.data(), 3 * m * sizeof(int32_t));
+    write(twins.data(), 3 * m * sizeof(int32_t));
+    write(boundary_next.data(), nb * sizeof(int32_t));
+    write(adjacency.offsets.data(), (n + 1) * sizeof(int32_t));
+    write(adjacency.neighbors.data(), ne * sizeof(int32_t));
+    write(adjacency.reverse.data(), ne * sizeof(int32_t));
+    if (cache_weights) write(cotangent_weights.data(), ne * sizeof(double));
+    ofs.close();
+    if (ofs.fail() || rename(temporary.c_str(), cache_path) != 0) {
+        remove(temporary.c_str());
+        return false;
     }
-    p_prime = p;
-    this->ResetConstraints();
+    return true;
+}
 
+// function SaveObjFile
+// writes the current positions p_prime and the triangles as an obj model,
+// with the shortest decimal form that reads back to the same doubles
+bool Mesh::SaveObjFile(const char *filename) const {
+    if (filename==NULL || strlen(filename)==0) return false;
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) return false;
+
+    char buf[128];
+    for (int i = 0; i < p_prime.cols(); i++) {
+        char *c = buf;
+        *c++ = 'v';
+        for (int k = 0; k < 3; k++) {
+            *c++ = ' ';
+            c = to_chars(c, buf + sizeof(buf), p_prime(k,i)).ptr;
+        }
+        *c++ = '\n';
+        fwrite(buf, 1, c - buf, file);
+    }
+    for (int f = 0; f < faces.cols(); f++)
+        fprintf(file, "f %d %d %d\n", faces(0,f) + 1, faces(1,f) + 1, faces(2,f) + 1);
+    return fclose(file) == 0;
+}
+
+// function SaveBinaryFile
+// writes the current positions p_prime and the triangles in the deformed mesh
+// format of mesh_cache.hpp, in the byte order of the machine
+bool Mesh::SaveBinaryFile(const char *filename) const {
+    if (filename==NULL || strlen(filename)==0) return false;
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) return false;
+
+    MeshOutputHeader header;
+    memcpy(header.magic, MESH_OUTPUT_MAGIC, sizeof(header.magic));
+    header.version = MESH_OUTPUT_VERSION;
+    header.flags = 0;
+    header.num_vertices = (int32_t)p_prime.cols();
+    header.num_faces = (int32_t)faces.cols();
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(p_prime.data(), sizeof(double), 3 * p_prime.cols(), file);
+    fwrite(faces.data(), sizeof(int32_t), 3 * faces.cols(), file);
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// function LoadBinaryFile
+// reads the positions of a file written by SaveBinaryFile back into p_prime.
+// the file has to be a deformation of the loaded mesh: same vertex count and
+// same triangles. nothing changes if it is not
+bool Mesh::LoadBinaryFile(const char *filename) {
+    if (filename==NULL || strlen(filename)==0) return false;
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) return false;
+
+    MeshOutputHeader header;
+    Eigen::Matrix<double, 3, Eigen::Dynamic> positions;
+    Eigen::Matrix<int, 3, Eigen::Dynamic> triangles;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+            && memcmp(header.magic, MESH_OUTPUT_MAGIC, sizeof(header.magic)) == 0
+            && header.version == MESH_OUTPUT_VERSION
+            && header.num_vertices == p_prime.cols() && header.num_faces == faces.cols();
+    if (ok) {
+        positions.resize(3, header.num_vertices);
+        triangles.resize(3, header.num_faces);
+        ok = fread(positions.data(), sizeof(double), positions.size(), file) == (size_t)positions.size()
+                && fread(triangles.data(), sizeof(int32_t), triangles.size(), file) == (size_t)triangles.size()
+                && triangles == faces;
+    }
+    fclose(file);
+    if (!ok) return false;
+    p_prime = positions;
+    vertex_version++;
     return true;
 }
 
@@ -209,11 +474,43 @@ const vector<Vertex*> Mesh::GetNeighbors(Vertex* v) {
     return neighbors;
 }
 
+/* Flatten the one-rings of all vertices so the solver does not walk half edges */
+void Mesh::BuildAdjacency() {
+    adjacency.offsets.resize(vList.size() + 1);
+    adjacency.neighbors.clear();
+    adjacency.neighbors.reserve(heList.size() + bheList.size());
+    adjacency.offsets[0] = 0;
+    for(int i = 0; i < vList.size(); i++){
+        OneRingVertex ring(vList[i]);
+        Vertex *curr = nullptr;
+        while(curr = ring.NextVertex()){
+            adjacency.neighbors.push_back(curr->Index());
+        }
+        adjacency.offsets[i+1] = (int)adjacency.neighbors.size();
+    }
+
+    /* Pair every edge with its opposite edge */
+    adjacency.reverse.assign(adjacency.neighbors.size(), -1);
+    for(int i = 0; i < vList.size(); i++){
+        for(int e = adjacency.Begin(i); e < adjacency.End(i); e++){
+            int j = adjacency.neighbors[e];
+            for(int f = adjacency.Begin(j); f < adjacency.End(j); f++){
+                if(adjacency.neighbors[f] == i){
+                    adjacency.reverse[e] = f;
+                    break;
+                }
+            }
+        }
+    }
+    adjacency.weights.assign(adjacency.neighbors.size(), 0.0);
+}
+
 /* Set anchors from file, the others are handles by default */
-void Mesh::SetConstraints(const char* anchor_path) {
+bool Mesh::SetConstraints(const char* anchor_path) {
     this->ResetConstraints();
-    this->SetAnchors(anchor_path);
+    bool ok = this->SetAnchors(anchor_path);
     this->SetHandles();
+    return ok;
 }
 
 /* Set anchors and handles from GUI, the others are anchors by default */
@@ -228,8 +525,7 @@ void Mesh::ResetConstraints() {
     anchors.clear();
     for(auto v: vList){
         if(v->IsBoundary()){
-            Point point(v->Position().X(), v->Position().Y(), v->Position().Z());
-            anchors[v->Index()] = point;
+            anchors[v->Index()] = p_prime.col(v->Index());
             v->SetType(STATIONARY);
         }
         else{
@@ -239,32 +535,36 @@ void Mesh::ResetConstraints() {
     this->SetHandles();
 }
 
-void Mesh::SetAnchors(const char *anchor_path) {
-    assert(anchor_path != nullptr && strlen(anchor_path) > 0);
+/* Set anchors from file, one "index x y z" per line, blank lines and # comments are skipped.
+ * Nothing changes if the file cannot be read or has a malformed line */
+bool Mesh::SetAnchors(const char *anchor_path) {
+    if(anchor_path == nullptr || strlen(anchor_path) == 0) return false;
     ifstream ifs(anchor_path);
-    assert(ifs.fail() == false);
+    if(ifs.fail()) return false;
 
-    char buf[1024];
-    do{
-        ifs.getline(buf, 1024);
-        istrstream iss(buf);
+    vector<pair<int, Point>> parsed;
+    string line;
+    while(getline(ifs, line)){
+        size_t first = line.find_first_not_of(" \t\r");
+        if(first == string::npos || line[first] == '#') continue;
+        istringstream iss(line);
         int idx;
         double x, y, z;
-        iss >> idx >> x >> y >> z;
-        Point new_point(x,y,z);
-        anchors[idx] = new_point;
-        p_prime.col(idx) = new_point;
-        vList[idx]->SetType(ANCHOR);
-    }while(!ifs.eof());
-    ifs.close();
+        if(!(iss >> idx >> x >> y >> z) || idx < 0 || idx >= (int)vList.size()) return false;
+        parsed.emplace_back(idx, Point(x, y, z));
+    }
+    for(auto &anchor: parsed){
+        anchors[anchor.first] = anchor.second;
+        p_prime.col(anchor.first) = anchor.second;
+        vList[anchor.first]->SetType(ANCHOR);
+    }
+    vertex_version++;
+    return true;
 }
 
 void Mesh::SetAnchors(vector<int> _anchors){
     for(auto idx: _anchors){
-        auto pos = vList[idx]->Position();
-        Point point(pos.X(), pos.Y(), pos.Z());
-        anchors[idx] = point;
-        p_prime.col(idx) = point;
+        anchors[idx] = p_prime.col(idx);
         vList[idx]->SetType(ANCHOR);
     }
 }
@@ -280,105 +580,154 @@ void Mesh::SetHandles() {
     handle_num = handle_cnt;
 }
 
+/* The weight functions fill in what each vertex contributes to its edges,
+ * the contributions of both ends are summed into the edge weight */
 void Mesh::InitWeights(WEIGHT_TYPE weight_type) {
+    ARAP_PROFILE_STAGE(PROFILE_INIT_WEIGHTS);
     switch(weight_type){
         case UNIFORM:
             this->InitUniformWeights();
             break;
         case COTANGENT:
+            if(!cotangent_weights.empty()){
+                /* summed weights from the mesh cache */
+                adjacency.weights = cotangent_weights;
+                return;
+            }
             this->InitCotangentWeights();
             break;
     }
+
+    vector<double> contributions;
+    contributions.swap(adjacency.weights);
+    adjacency.weights.resize(contributions.size());
+    for(int e = 0; e < contributions.size(); e++){
+        int f = adjacency.reverse[e];
+        adjacency.weights[e] = contributions[e] + (f == -1 ? 0.0 : contributions[f]);
+    }
 }
 
 void Mesh::InitUniformWeights() {
-    vector<Eigen::Triplet<double>> weight_list;
-    weight_list.reserve(fList.size()*3);
-
-    for(int i = 0; i < vList.size(); i++){
-        vector<Vertex*> neighbors = this->GetNeighbors(vList[i]);
-        for(auto v: neighbors){
-            int j = v->Index();
-            weight_list.emplace_back(Eigen::Triplet<double>(i,j,1.0));
-            weight_list.emplace_back(Eigen::Triplet<double>(j,i,1.0));
-        }
-    }
-    weights.resize(vList.size(), vList.size());
-    weights.setZero();
-    weights.setFromTriplets(weight_list.begin(), weight_list.end());
+    fill(adjacency.weights.begin(), adjacency.weights.end(), 1.0);
 }
 
 void Mesh::InitCotangentWeights(){
-    vector<Eigen::Triplet<double>> weight_list;
-    weight_list.reserve(fList.size()*3);
-
     for(int i = 0; i < vList.size(); i++){
-        vector<Vertex*> neighbors = this->GetNeighbors(vList[i]);
-
-        /* Compute weight for each pair */
-        Vector3d v = vList[i]->Position();
-        Vector3d curr = neighbors[0]->Position();
-        Vector3d next = neighbors[1]->Position();
-        Vector3d prev = neighbors[neighbors.size()-1]->Position();
-        double cot_alpha = Cot(v, prev, curr);
-        double cot_beta = Cot(v, next, curr);
-        double weight = (cot_alpha + cot_beta) / 2.0;
-        weight_list.emplace_back(Eigen::Triplet<double>(i,neighbors[0]->Index(),weight));
-        weight_list.emplace_back(Eigen::Triplet<double>(neighbors[0]->Index(),i,weight));
-
-        for(int j = 1; j < neighbors.size() - 1; j++){
-            curr = neighbors[j]->Position();
-            next = neighbors[j+1]->Position();
-            prev = neighbors[j-1]->Position();
-            cot_alpha = Cot(v, prev, curr);
-            cot_beta = Cot(v, next, curr);
-            weight = (cot_alpha + cot_beta) / 2.0;
-            weight_list.emplace_back(Eigen::Triplet<double>(i,neighbors[j]->Index(),weight));
-            weight_list.emplace_back(Eigen::Triplet<double>(neighbors[j]->Index(),i,weight));
-        }
-        curr = neighbors[neighbors.size()-1]->Position();
-        next = neighbors[0]->Position();
-        prev = neighbors[neighbors.size()-2]->Position();
-        cot_alpha = Cot(v, prev, curr);
-        cot_beta = Cot(v, next, curr);
-        weight = (cot_alpha + cot_beta) / 2.0;
-        weight_list.emplace_back(Eigen::Triplet<double>(i,neighbors[neighbors.size()-1]->Index(),weight));
-        weight_list.emplace_back(Eigen::Triplet<double>(neighbors[neighbors.size()-1]->Index(),i,weight));
-    }
-
-    weights.resize(vList.size(), vList.size());
-    weights.setZero();
-    weights.setFromTriplets(weight_list.begin(), weight_list.end());
+        const int *neighbors = &adjacency.neighbors[adjacency.Begin(i)];
+        double *weights = &adjacency.weights[adjacency.Begin(i)];
+        int valence = adjacency.Valence(i);
+
+        /* Compute weight for each pair on the rest pose */
+        Vector3d v = RestPosition(i);
+        for(int k = 0; k < valence; k++){
+            Vector3d curr = RestPosition(neighbors[k]);
+            Vector3d next = RestPosition(neighbors[(k+1) % valence]);
+            Vector3d prev = RestPosition(neighbors[(k+valence-1) % valence]);
+            double cot_alpha = Cot(v, prev, curr);
+            double cot_beta = Cot(v, next, curr);
+            weights[k] = (cot_alpha + cot_beta) / 2.0;
+        }
+    }
 }
 
 void Mesh::InitRotations() {
+    ARAP_PROFILE_STAGE(PROFILE_INIT_ROTATIONS);
     rotations.clear();
     rotations.resize(vList.size(), Eigen::Matrix3d::Identity());
 }
 
 void Mesh::InitHandleMapping() {
+    ARAP_PROFILE_STAGE(PROFILE_INIT_HANDLE_MAPPING);
     handleMap.resize(vList.size());
+    handleVertices.clear();
+    int n = (int)vList.size();
+
+    /* ELIMINATION drops the anchors from L. A fixed Laplacian drops one ground vertex
+     * per connected component instead, which makes it definite without changing the
+     * solution: the first hard anchor of the component, else its first vertex */
+    vector<char> eliminated(n, 0);
+    if(constraint_mode == ELIMINATION){
+        for(auto &anchor: anchors) eliminated[anchor.first] = 1;
+    }
+    else{
+        bool hard = anchor_stiffness == 0;
+        vector<char> visited(n, 0);
+        vector<int> queue;
+        for(int s = 0; s < n; s++){
+            if(visited[s]) continue;
+            int ground = s;
+            bool anchored = hard && anchors.count(s) > 0;
+            queue.assign(1, s);
+            visited[s] = 1;
+            for(size_t q = 0; q < queue.size(); q++){
+                int i = queue[q];
+                if(!anchored && hard && anchors.count(i) > 0){
+                    ground = i;
+                    anchored = true;
+                }
+                for(int e = adjacency.Begin(i); e < adjacency.End(i); e++){
+                    int j = adjacency.neighbors[e];
+                    if(!visited[j]){
+                        visited[j] = 1;
+                        queue.push_back(j);
+                    }
+                }
+            }
+            eliminated[ground] = 1;
+        }
+    }
+
     int index = 0;
-    for(int i = 0; i < vList.size(); i++){
-        if(anchors.find(i) != anchors.end()){
+    for(int i = 0; i < n; i++){
+        if(eliminated[i]){
             handleMap[i] = -1;
         }
         else{
             handleMap[i] = index;
+            handleVertices.push_back(i);
             index++;
         }
     }
 }
 
+int Mesh::NumThreads() const {
+#ifdef _OPENMP
+    return num_threads > 0 ? num_threads : omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/* Constraint topology the linear system depends on */
+ConstraintSignature Mesh::GetSignature(WEIGHT_TYPE weight_type) const {
+    ConstraintSignature sig;
+    sig.anchor_indices.reserve(anchors.size());
+    for(auto &anchor: anchors){
+        sig.anchor_indices.push_back(anchor.first);
+    }
+    sort(sig.anchor_indices.begin(), sig.anchor_indices.end());
+    sig.weight_type = weight_type;
+    sig.constraint_mode = constraint_mode;
+    sig.linear_solver = linear_solver;
+    if(linear_solver == CONJUGATE_GRADIENT){
+        sig.preconditioner = preconditioner;
+        sig.solver_tolerance = solver_tolerance;
+    }
+    sig.anchor_stiffness = constraint_mode == FIXED_LAPLACIAN ? anchor_stiffness : 0;
+    sig.valid = true;
+    return sig;
+}
+
 void Mesh::BuildLinearSystem() {
-    L.resize(handle_num, handle_num);
-    L.reserve(Eigen::VectorXi::Constant(handle_num, 7));
+    ARAP_PROFILE_STAGE(PROFILE_BUILD_LINEAR_SYSTEM);
+    int handles = (int)handleVertices.size();
+    L.resize(handles, handles);
+    L.reserve(Eigen::VectorXi::Constant(handles, 7));
     L.setZero();
-    b_init.resize(3, handle_num);
-    b_init.setZero();
+    anchor_terms.clear();
 
     vector<Eigen::Triplet<double>> triplets;
-    triplets.reserve(7 * handle_num);
+    triplets.reserve(8 * handles);
 
     for(int i = 0; i < vList.size(); i++){
         assert(i == vList[i]->Index());
@@ -386,15 +735,12 @@ void Mesh::BuildLinearSystem() {
         if(handle_idx1 == -1){
             continue;
         }
-        /* Get neighbor vertices */
-        vector<Vertex*> neighbors = this->GetNeighbors(vList[i]);
-
-        for(auto curr: neighbors){
-            int j = curr->Index();
-            double w = weights.coeff(i, j);
+        for(int e = adjacency.Begin(i); e < adjacency.End(i); e++){
+            int j = adjacency.neighbors[e];
+            double w = adjacency.weights[e];
             int handle_idx2 = handleMap[j];
             if(handle_idx2 == -1){
-                b_init.col(handle_idx1) += w * anchors[j];
+                anchor_terms.push_back({handle_idx1, j, w});
             }
             else{
                 triplets.emplace_back(Eigen::Triplet<double>(handle_idx1, handle_idx2, -w));
@@ -403,91 +749,453 @@ void Mesh::BuildLinearSystem() {
         }
     }
     L.setFromTriplets(triplets.begin(), triplets.end());
-    solver.compute(L);
+    this->FactorizeLinearSystem();
+    ARAP_PROFILE_COUNT(profile.nonzeros = L.nonZeros());
+    ARAP_PROFILE_COUNT(profile.handles = handles);
+}
+
+/* Redo the symbolic analysis only if the sparsity pattern of L changed. The
+ * iterative solver only copies L, L is symmetric so its columns are its rows */
+void Mesh::FactorizeLinearSystem() {
+    L.makeCompressed();
+    if(linear_solver == CONJUGATE_GRADIENT){
+        iterative_solver.Assign((int)L.rows(), (int)L.cols(), L.outerIndexPtr(), L.innerIndexPtr(), L.valuePtr());
+        iterative_solver.SetPreconditioner(preconditioner);
+        return;
+    }
+    const int *outer = L.outerIndexPtr(), *inner = L.innerIndexPtr();
+    bool same_pattern = pattern_outer.size() == L.outerSize() + 1
+            && equal(pattern_outer.begin(), pattern_outer.end(), outer)
+            && pattern_inner.size() == L.nonZeros()
+            && equal(pattern_inner.begin(), pattern_inner.end(), inner);
+    if(!same_pattern){
+        solver.analyzePattern(L);
+        pattern_outer.assign(outer, outer + L.outerSize() + 1);
+        pattern_inner.assign(inner, inner + L.nonZeros());
+        factorization_counter.analyses++;
+    }
+    solver.factorize(L);
+    factorization_counter.factorizations++;
     assert(solver.info() == Eigen::Success);
 }
 
-void Mesh::EstimateRotations() {
+/* Move the anchor positions to the right hand side, L stays untouched.
+ * Anchors freed by a constraint update are unknowns of the border instead */
+void Mesh::BuildAnchorTerms() {
+    ARAP_PROFILE_STAGE(PROFILE_BUILD_ANCHOR_TERMS);
+    b_init.setZero(L.rows(), 3);
+    for(auto &term: anchor_terms){
+        /* only pinned anchors, a soft or freed one is solved for on the border */
+        auto anchor = anchors.find(term.anchor);
+        if(anchor != anchors.end() && !constraint_update.Contains(term.anchor)){
+            b_init.row(term.handle) += term.weight * anchor->second.transpose();
+        }
+    }
+}
+
+/* Border the factorized system with the anchors that changed since it was built, see
+ * ConstraintUpdate. The columns of L^-1 B of anchors that were already changed in the
+ * previous update are kept, so an edit of one anchor costs one solve with the factors
+ * and the Schur complement of the border. Returns false if L has to be rebuilt */
+bool Mesh::UpdateConstraints(const ConstraintSignature &current) {
+    if(!signature.SameSystem(current)){
+        return false;
+    }
+    /* The border holds the anchors that are handles of L and the eliminated vertices
+     * that are no hard anchor now: freed anchors, the grounds of a fixed Laplacian */
+    const vector<int> &before = signature.anchor_indices, &after = current.anchor_indices;
+    double stiffness = current.anchor_stiffness;
+    vector<int> changed, border;
+    set_union(before.begin(), before.end(), after.begin(), after.end(), back_inserter(changed));
+    for(int v: changed){
+        bool pinned = stiffness == 0 && binary_search(after.begin(), after.end(), v);
+        if(handleMap[v] >= 0 || !pinned) border.push_back(v);
+    }
+    if(border.empty()){
+        return false;
+    }
+    /* a fixed Laplacian is never refactorized for its anchors */
+    if(current.constraint_mode == ELIMINATION && (int)border.size() > max_constraint_update){
+        return false;
+    }
+    /* without a factorization rebuilding L is cheaper than a solve per border vertex */
+    if(current.constraint_mode == ELIMINATION && current.linear_solver == CONJUGATE_GRADIENT){
+        return false;
+    }
+    ARAP_PROFILE_STAGE(PROFILE_UPDATE_CONSTRAINTS);
+
+    /* Columns of B: -w to the handle neighbors of a freed anchor, 1 at a new anchor */
+    int n = (int)L.rows(), m = (int)border.size();
+    auto column = [&](int v){
+        Eigen::VectorXd col = Eigen::VectorXd::Zero(n);
+        if(handleMap[v] >= 0){
+            col[handleMap[v]] = 1;
+        }
+        else{
+            for(int e = adjacency.Begin(v); e < adjacency.End(v); e++){
+                int j = adjacency.neighbors[e];
+                if(handleMap[j] >= 0) col[handleMap[j]] = -adjacency.weights[e];
+            }
+        }
+        return col;
+    };
+    /* (B^T y)_p of the border vertex v */
+    auto border_dot = [&](int v, const Eigen::VectorXd &y){
+        if(handleMap[v] >= 0) return y[handleMap[v]];
+        double dot = 0;
+        for(int e = adjacency.Begin(v); e < adjacency.End(v); e++){
+            int j = adjacency.neighbors[e];
+            if(handleMap[j] >= 0) dot -= adjacency.weights[e] * y[handleMap[j]];
+        }
+        return dot;
+    };
+
+    vector<Eigen::VectorXd> z(m);
+    for(int p = 0; p < m; p++){
+        auto kept = lower_bound(constraint_update.border.begin(), constraint_update.border.end(), border[p]);
+        if(kept != constraint_update.border.end() && *kept == border[p]){
+            z[p].swap(constraint_update.z[kept - constraint_update.border.begin()]);
+        }
+        else if(linear_solver == CONJUGATE_GRADIENT){
+            Eigen::VectorXd col = column(border[p]);
+            z[p].setZero(n);
+            iterative_solver.SetNumThreads(NumThreads());
+            iterative_solver.PCG(col.data(), z[p].data(), 1, solver_tolerance, max_solver_iterations);
+            ARAP_PROFILE_COUNT(profile.solver_iterations += iterative_solver.Iterations());
+        }
+        else{
+            z[p] = solver.solve(column(border[p]));
+        }
+    }
+
+    /* S = D - B^T Z, D couples the freed vertices like L couples the handles and
+     * holds -1/stiffness for the soft anchors among the handles, +stiffness for the others */
+    Eigen::MatrixXd S(m, m);
+    for(int p = 0; p < m; p++){
+        for(int q = 0; q < m; q++){
+            S(p, q) = -border_dot(border[p], z[q]);
+        }
+        int v = border[p];
+        bool soft = stiffness > 0 && binary_search(after.begin(), after.end(), v);
+        if(handleMap[v] >= 0){
+            if(soft) S(p, p) -= 1 / stiffness;
+            continue;
+        }
+        if(soft) S(p, p) += stiffness;
+        for(int e = adjacency.Begin(v); e < adjacency.End(v); e++){
+            S(p, p) += adjacency.weights[e];
+            auto other = lower_bound(border.begin(), border.end(), adjacency.neighbors[e]);
+            if(other != border.end() && *other == adjacency.neighbors[e] && handleMap[*other] < 0){
+                S(p, other - border.begin()) -= adjacency.weights[e];
+            }
+        }
+    }
+
+    constraint_update.signature = current;
+    constraint_update.border.swap(border);
+    constraint_update.z.swap(z);
+    constraint_update.schur.compute(S);
+    return true;
+}
+
+void Mesh::InitEdgeVectors() {
+    ARAP_PROFILE_STAGE(PROFILE_INIT_EDGE_VECTORS);
+    edge_vectors.resize(3, adjacency.neighbors.size());
     for(int i = 0; i < vList.size(); i++){
-        auto pi = p.col(i);
-        auto ppi = p_prime.col(i);
-        /* Compute covariance matrix */
-        vector<Vertex*> neighbors = this->GetNeighbors(vList[i]);
-        Eigen::Matrix3d covariance;
-        covariance.setZero();
-        for(auto curr: neighbors){
-            int j = curr->Index();
-            double w = weights.coeff(i, j);
-            auto pj = p.col(j);
-            auto ppj = p_prime.col(j);
-            covariance += w * (pi - pj) * ((ppi - ppj).transpose());
-        }
-        /* SVD Decomposition */
-        Eigen::JacobiSVD<Eigen::Matrix3d> svd(covariance, Eigen::ComputeFullU | Eigen::ComputeFullV);
-        Eigen::Matrix3d Ut = svd.matrixU().transpose();
-        Eigen::Matrix3d V = svd.matrixV();
-
-        /* Get rotation matrix */
-        Eigen::Matrix3d I;
-        I.setIdentity();
-        I(2,2) = (V * Ut).determinant();
-        rotations[i] = (V * I * Ut);
-        assert(abs(rotations[i].determinant()-1) <= 1e-10);
+        for(int e = adjacency.Begin(i); e < adjacency.End(i); e++){
+            edge_vectors.col(e) = p.col(i) - p.col(adjacency.neighbors[e]);
+        }
+    }
+}
+
+/* Covariance of the edges around vertex i between the rest pose and the deformed pose */
+Eigen::Matrix3d Mesh::Covariance(int i) const {
+    auto ppi = p_prime.col(i);
+    Eigen::Matrix3d covariance;
+    covariance.setZero();
+    for(int e = adjacency.Begin(i); e < adjacency.End(i); e++){
+        int j = adjacency.neighbors[e];
+        double w = adjacency.weights[e];
+        auto ppj = p_prime.col(j);
+        covariance += w * edge_vectors.col(e) * ((ppi - ppj).transpose());
+    }
+    return covariance;
+}
+
+/* Every vertex writes only its own rotation, so the result does not depend on the thread count */
+void Mesh::EstimateRotations() {
+    ARAP_PROFILE_STAGE(PROFILE_ESTIMATE_ROTATIONS);
+    int n = (int)vList.size();
+    if(rotation_solver == JACOBI_SVD){
+        #pragma omp parallel for schedule(static) num_threads(NumThreads())
+        for(int i = 0; i < n; i++){
+            rotations[i] = SvdRotation(Covariance(i));
+            assert(abs(rotations[i].determinant()-1) <= 1e-10);
+        }
+        return;
+    }
+
+    /* Fit ROTATION_LANES vertices at once, the last group is padded with identities */
+    int groups = (n + ROTATION_LANES - 1) / ROTATION_LANES;
+    #pragma omp parallel for schedule(static) num_threads(NumThreads())
+    for(int g = 0; g < groups; g++){
+        double S[3][3][ROTATION_LANES], R[3][3][ROTATION_LANES];
+        for(int l = 0; l < ROTATION_LANES; l++){
+            int i = g * ROTATION_LANES + l;
+            Eigen::Matrix3d covariance = i < n ? Covariance(i) : Eigen::Matrix3d::Identity();
+            for(int r = 0; r < 3; r++)
+                for(int c = 0; c < 3; c++) S[r][c][l] = covariance(r, c);
+        }
+        FastRotations(S, R);
+        for(int l = 0; l < ROTATION_LANES && g * ROTATION_LANES + l < n; l++){
+            int i = g * ROTATION_LANES + l;
+            for(int r = 0; r < 3; r++)
+                for(int c = 0; c < 3; c++) rotations[i](r, c) = R[r][c][l];
+            assert(abs(rotations[i].determinant()-1) <= 1e-10);
+        }
     }
 }
 
+/* Every handle row is assembled by its own vertex, so the rows can be filled in parallel */
 void Mesh::SolveLinearSystem() {
-    b = b_init;
-    for(int i = 0; i < vList.size(); i++){
-        int handle_idx = handleMap[i];
-        if(handle_idx == -1){
+    ARAP_PROFILE_STAGE(PROFILE_SOLVE_LINEAR_SYSTEM);
+    int handles = (int)handleVertices.size();
+    b.resize(handles, 3);
+    #pragma omp parallel for schedule(static) num_threads(NumThreads())
+    for(int h = 0; h < handles; h++){
+        int i = handleVertices[h];
+        Eigen::RowVector3d row = b_init.row(h);
+        for(int e = adjacency.Begin(i); e < adjacency.End(i); e++){
+            int j = adjacency.neighbors[e];
+            double w = adjacency.weights[e];
+            Eigen::Matrix3d R = rotations[i] + rotations[j];
+            row += (R * edge_vectors.col(e) * w * 0.5).transpose();
+        }
+        b.row(h) = row;
+    }
+
+    /* Solve all three dimensions at once */
+    PointRows x;
+    if(linear_solver == CONJUGATE_GRADIENT) this->SolveIterative(b, x);
+    else this->SolveFactorized(b, x);
+    if(constraint_update.Active()){
+        this->SolveConstraintUpdate(x);
+    }
+    for(int k = 0; k < handleVertices.size(); k++){
+        p_prime.col(handleVertices[k]) = x.row(k).transpose();
+    }
+    vertex_version++;
+}
+
+/* Correct the solution y = L^-1 b of the factorized system for the border:
+ * v = S^-1 (g - B^T y), x = y - Z v. The freed anchors get their rows of v, the
+ * new anchors keep their positions */
+void Mesh::SolveConstraintUpdate(PointRows &x) {
+    const vector<int> &border = constraint_update.border;
+    bool soft = constraint_update.signature.anchor_stiffness > 0;
+    int m = (int)border.size();
+    Eigen::MatrixXd g(m, 3);
+    for(int p = 0; p < m; p++){
+        int i = border[p];
+        if(handleMap[i] >= 0){
+            g.row(p) = anchors[i].transpose() - x.row(handleMap[i]);
             continue;
         }
-        vector<Vertex*> neighbors = this->GetNeighbors(vList[i]);
-        for(auto curr: neighbors){
-            int j = curr->Index();
-            double w = weights.coeff(i, j);
+        /* the row of a freed vertex, assembled like the handle rows */
+        Eigen::RowVector3d row = Eigen::RowVector3d::Zero();
+        auto own = anchors.find(i);
+        if(soft && own != anchors.end()) row += constraint_update.signature.anchor_stiffness * own->second.transpose();
+        for(int e = adjacency.Begin(i); e < adjacency.End(i); e++){
+            int j = adjacency.neighbors[e];
+            double w = adjacency.weights[e];
             Eigen::Matrix3d R = rotations[i] + rotations[j];
-            Eigen::Matrix<double, 3, 1> point = R * (p.col(i) - p.col(j)) * w * 0.5;
-            b.col(handle_idx) += point;
+            row += (R * edge_vectors.col(e) * w * 0.5).transpose();
+            if(handleMap[j] >= 0){
+                row += w * x.row(handleMap[j]);
+            }
+            else if(!constraint_update.Contains(j)){
+                row += w * anchors[j].transpose();
+            }
         }
+        g.row(p) = row;
     }
 
-    /* Solve one dimension at one time */
-    Eigen::Matrix<double, Eigen::Dynamic, 1> x;
-    for(int i = 0; i < 3; i++){
-        x = solver.solve(b.row(i).transpose());
+    Eigen::MatrixXd v = constraint_update.schur.solve(g);
+    for(int p = 0; p < m; p++){
+        x -= constraint_update.z[p] * v.row(p);
+    }
+    for(int p = 0; p < m; p++){
+        int i = border[p];
+        if(handleMap[i] >= 0){
+            if(!soft) x.row(handleMap[i]) = anchors[i].transpose();
+        }
+        else p_prime.col(i) = v.row(p).transpose();
+    }
+}
 
-        int idx = 0;
-        for(int j = 0; j < vList.size(); j++){
-            if(handleMap[j] != -1){
-                p_prime(i, j) = x(idx);
-                idx++;
-            }
+/* x = P^-1 L^-T D^-1 L^-1 P rhs with the LDLT factors of the solver. Unlike
+ * solver.solve(), which sweeps the factor once per column, every triangular
+ * sweep updates the three coordinates of a row together */
+void Mesh::SolveFactorized(const PointRows &rhs, PointRows &x) const {
+    const auto &factor = solver.matrixL().nestedExpression();
+    const int *outer = factor.outerIndexPtr();
+    const int *inner = factor.innerIndexPtr();
+    const double *values = factor.valuePtr();
+    const auto &diagonal = solver.vectorD();
+    int n = (int)factor.cols();
+
+    if(solver.permutationP().size() > 0) x = solver.permutationP() * rhs;
+    else x = rhs;
+    double *data = x.data();
+
+    /* L y = P rhs, column oriented */
+    for(int j = 0; j < n; j++){
+        const double *xj = data + 3 * j;
+        for(int k = outer[j]; k < outer[j+1]; k++){
+            double *xi = data + 3 * inner[k];
+            xi[0] -= values[k] * xj[0];
+            xi[1] -= values[k] * xj[1];
+            xi[2] -= values[k] * xj[2];
+        }
+    }
+
+    /* L^T x = D^-1 y, row oriented on the columns of L */
+    for(int j = n - 1; j >= 0; j--){
+        double *xj = data + 3 * j;
+        double d = 1.0 / diagonal[j];
+        xj[0] *= d;
+        xj[1] *= d;
+        xj[2] *= d;
+        for(int k = outer[j]; k < outer[j+1]; k++){
+            const double *xi = data + 3 * inner[k];
+            xj[0] -= values[k] * xi[0];
+            xj[1] -= values[k] * xi[1];
+            xj[2] -= values[k] * xi[2];
         }
     }
+
+    if(solver.permutationPinv().size() > 0) x = solver.permutationPinv() * x;
 }
 
-void Mesh::UpdateVertices() {
-    for(int i = 0; i < vList.size(); i++){
-        auto pos = p_prime.col(i);
-        vList[i]->SetPosition(Vector3d(pos[0], pos[1], pos[2]));
+/* Conjugate gradients on all three coordinates together, starting from the
+ * current positions of the handles: the previous iteration or Deform call */
+void Mesh::SolveIterative(const PointRows &rhs, PointRows &x) {
+    int handles = (int)handleVertices.size();
+    x.resize(handles, 3);
+    for(int k = 0; k < handles; k++){
+        x.row(k) = p_prime.col(handleVertices[k]).transpose();
     }
+    iterative_solver.SetNumThreads(NumThreads());
+    iterative_solver.PCG(rhs.data(), x.data(), 3, solver_tolerance, max_solver_iterations);
+    ARAP_PROFILE_COUNT(profile.solver_iterations += iterative_solver.Iterations());
+}
+
+/* ARAP energy sum_i sum_j w_ij |(p'_i - p'_j) - R_i (p_i - p_j)|^2 of the current
+ * positions and rotations, summed per vertex so the result does not depend on the threads */
+double Mesh::Energy() const {
+    int n = (int)vList.size();
+    vector<double> vertex_energy(n);
+    #pragma omp parallel for schedule(static) num_threads(NumThreads())
+    for(int i = 0; i < n; i++){
+        double energy = 0;
+        for(int e = adjacency.Begin(i); e < adjacency.End(i); e++){
+            int j = adjacency.neighbors[e];
+            Point residual = (p_prime.col(i) - p_prime.col(j)) - rotations[i] * edge_vectors.col(e);
+            energy += adjacency.weights[e] * residual.squaredNorm();
+        }
+        vertex_energy[i] = energy;
+    }
+    double energy = 0;
+    for(double e: vertex_energy) energy += e;
+    return energy;
 }
 
 void Mesh::Deform(int num_iterations, WEIGHT_TYPE weight_type){
-    /* Build linear system */
-    InitRotations();
-    InitWeights(weight_type);
-    InitHandleMapping();
-    BuildLinearSystem();
+    DeformOptions options;
+    options.max_iterations = num_iterations;
+    options.track_energy = false;
+    this->Deform(options, weight_type);
+}
+
+DeformStats Mesh::Deform(const DeformOptions &options, WEIGHT_TYPE weight_type){
+    DeformStats stats;
+    auto start = chrono::steady_clock::now();
+
+    /* Build linear system, the factorization is reused if the constraints kept their topology.
+     * A warm start keeps the rotations of the previous call, which belong to p_prime */
+    ConstraintSignature current = GetSignature(weight_type);
+    bool same = constraint_update.Active() ? current == constraint_update.signature : current == signature;
+    bool warm = warm_start && same && rotations.size() == vList.size();
+    if(!warm){
+        InitRotations();
+    }
+    if(current == signature){
+        constraint_update.Clear();
+        ARAP_PROFILE_COUNT(profile.factorization_reuses++);
+    }
+    else if(same){
+        ARAP_PROFILE_COUNT(profile.factorization_reuses++);
+    }
+    else if(UpdateConstraints(current)){
+        ARAP_PROFILE_COUNT(profile.factorization_reuses++);
+        ARAP_PROFILE_COUNT(profile.constraint_updates++);
+    }
+    else{
+        /* A new system or too many changed anchors. L is factorized without the eliminated
+         * vertices and no anchor stiffness, the rest of the constraints go to the border */
+        constraint_update.Clear();
+        InitWeights(weight_type);
+        InitHandleMapping();
+        BuildLinearSystem();
+        signature = current;
+        signature.anchor_stiffness = 0;
+        signature.anchor_indices.clear();
+        for(int i = 0; i < vList.size(); i++){
+            if(handleMap[i] < 0) signature.anchor_indices.push_back(i);
+        }
+        if(signature != current){
+            UpdateConstraints(current);
+        }
+    }
+    ARAP_PROFILE_COUNT(profile.deforms++);
+    ARAP_PROFILE_COUNT(profile.anchors = (int)anchors.size());
+    BuildAnchorTerms();
+    InitEdgeVectors();
+
+    /* Interleaved iterations until one of the limits is reached */
+    bool track_energy = options.track_energy || options.tolerance > 0;
+    for(int i = 0; i < options.max_iterations; i++){
+        if(warm){
+            /* Carry on the alternation of the previous call: global step first */
+            SolveLinearSystem();
+            EstimateRotations();
+        }
+        else{
+            EstimateRotations();
+            SolveLinearSystem();
+        }
+        stats.iterations++;
+        ARAP_PROFILE_COUNT(profile.iterations++);
 
-    /* Interleaved iterations */
-    for(int i = 0; i < num_iterations; i++){
-        EstimateRotations();
-        SolveLinearSystem();
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        stats.times.push_back(elapsed);
+        if(track_energy){
+            {
+                ARAP_PROFILE_STAGE(PROFILE_ENERGY);
+                stats.energies.push_back(this->Energy());
+            }
+            if(options.tolerance > 0 && stats.energies.size() > 1){
+                double previous = stats.energies[stats.energies.size()-2];
+                if(previous - stats.energies.back() <= options.tolerance * previous){
+                    stats.converged = true;
+                    break;
+                }
+            }
+        }
+        if(options.time_budget > 0 && elapsed >= options.time_budget){
+            break;
+        }
     }
 
-    /* Update vertex positions */
-    UpdateVertices();
-}
\ No newline at end of file
+    return stats;
+}
@@ -9,6 +9,8 @@
 #include "config.h"
 #include <string>
 
+using namespace std;
+
 std::chrono::milliseconds start_time;
 
 
@@ -36,6 +38,7 @@ int main(int argc, char **argv){
     InitAnchorList();
     SetBoundaryBox(mesh.MinCoord(), mesh.MaxCoord());
 
+    mesh.warm_start = true;
     glutIdleFunc(sphere_deform1);
     start_time = std::chrono::duration_cast<std::chrono::milliseconds>(chrono::system_clock::now().time_since_epoch());
 
@@ -0,0 +1,103 @@
+#include "mesh.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The border of changed anchors on a factorized system (ConstraintUpdate) has to
+// give the same deformation as a system built for the new anchors. Applies one
+// anchor edit at a time, like the 'a', 'A' and 'h' keys of the viewer: promotes
+// free vertices to anchors, demotes anchors to free vertices and moves anchors.
+// After every edit the deformation is compared with a mesh that starts from the
+// same positions and rebuilds its system. With ELIMINATION the first
+// max_constraint_update edits must keep the factorization and the next one
+// must refactorize
+// Usage: ./arap_test_constraint_update ${Obj_path}
+
+const double TOLERANCE = 1e-9;
+const int EDITS = 40;
+
+struct Case {
+    string name;
+    CONSTRAINT_MODE constraint_mode;
+    double anchor_stiffness;
+};
+
+bool RunCase(const char *path, const Case &c) {
+    Mesh mesh, rebuilt;
+    if (!mesh.LoadObjFile(path) || !rebuilt.LoadObjFile(path)) {
+        cout << "Cannot load " << path << endl;
+        return false;
+    }
+    for (Mesh *m: {&mesh, &rebuilt}) {
+        m->constraint_mode = c.constraint_mode;
+        m->anchor_stiffness = c.anchor_stiffness;
+    }
+    int n = (int)mesh.Vertices().size();
+    vector<int> anchors;
+    for (int i = 0; i < n; i += 29) anchors.push_back(i);
+    mesh.SetConstraints(anchors);
+    mesh.Deform(3, COTANGENT);
+    size_t factorizations = mesh.factorization_counter.factorizations;
+
+    vector<char> touched(n, 0);
+    for (int i: anchors) touched[i] = 1;
+    int next = 0;
+    bool ok = true;
+    double worst = 0;
+    for (int edit = 1; edit <= EDITS; edit++) {
+        /* every edit touches a vertex no earlier edit touched, so the border grows by one */
+        if (edit % 3 == 0) {
+            anchors.erase(anchors.begin());                 // 'h': an anchor becomes free
+        }
+        else {
+            while (touched[next]) next++;
+            touched[next] = 1;
+            anchors.push_back(next);                        // 'a': a free vertex becomes an anchor
+        }
+        mesh.p_prime.col(anchors.back()) += Eigen::Vector3d(0.02, -0.01, 0.03);  // SetConstraints takes the targets from p_prime
+
+        rebuilt.p_prime = mesh.p_prime;
+        mesh.SetConstraints(anchors);
+        rebuilt.SetConstraints(anchors);
+        rebuilt.signature.valid = false;
+        mesh.Deform(3, COTANGENT);
+        rebuilt.Deform(3, COTANGENT);
+
+        double difference = (mesh.p_prime - rebuilt.p_prime).cwiseAbs().maxCoeff();
+        worst = max(worst, difference);
+        if (!(difference <= TOLERANCE)) {
+            cout << "FAIL " << c.name << ": edit " << edit << " differs by " << difference << endl;
+            ok = false;
+        }
+
+        if (c.constraint_mode == ELIMINATION) {
+            size_t expected = factorizations + (edit > mesh.max_constraint_update ? 1 : 0);
+            if (mesh.factorization_counter.factorizations != expected) {
+                cout << "FAIL " << c.name << ": edit " << edit << " ran " << mesh.factorization_counter.factorizations
+                     << " factorizations instead of " << expected << endl;
+                ok = false;
+            }
+        }
+    }
+    if (ok) cout << "ok   " << c.name << ": max difference " << worst << endl;
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        cout << "Usage: ./arap_test_constraint_update ${Obj_path}" << endl;
+        return 2;
+    }
+    const Case cases[] = {
+        {"elimination", ELIMINATION, 0},
+        {"fixed laplacian, hard anchors", FIXED_LAPLACIAN, 0},
+        {"fixed laplacian, soft anchors", FIXED_LAPLACIAN, 1e3},
+    };
+    int failures = 0;
+    for (const Case &c: cases) {
+        if (!RunCase(argv[1], c)) failures++;
+    }
+    return failures == 0 ? 0 : 1;
+}
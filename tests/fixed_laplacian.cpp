@@ -0,0 +1,61 @@
+#include "mesh.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// FIXED_LAPLACIAN constrains hard anchors on the border of a Laplacian that is
+// factorized once, for any number of anchors. Its deformation has to agree with
+// ELIMINATION, which factorizes L without the anchors: deforms both with many
+// anchors (more than max_constraint_update), then changes the anchors a few
+// times. The fixed Laplacian has to keep its single factorization throughout
+// Usage: ./arap_test_fixed_laplacian ${Obj_path} [uniform|cotangent]
+
+const double TOLERANCE = 1e-9;  // both solve the same system exactly, this leaves room for round-off
+const int EDITS = 5;
+
+vector<int> Anchors(int n, int stride, int offset) {
+    vector<int> anchors;
+    for (int i = offset; i < n; i += stride) anchors.push_back(i);
+    return anchors;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2 && argc != 3) {
+        cout << "Usage: ./arap_test_fixed_laplacian ${Obj_path} [uniform|cotangent]" << endl;
+        return 2;
+    }
+    WEIGHT_TYPE weight_type = argc == 3 && string(argv[2]) == "uniform" ? UNIFORM : COTANGENT;
+    Mesh fixed, eliminated;
+    if (!fixed.LoadObjFile(argv[1]) || !eliminated.LoadObjFile(argv[1])) {
+        cout << "Cannot load " << argv[1] << endl;
+        return 2;
+    }
+    fixed.constraint_mode = FIXED_LAPLACIAN;
+    eliminated.constraint_mode = ELIMINATION;
+    int n = (int)fixed.Vertices().size();
+    int stride = max(2, n / (2 * fixed.max_constraint_update));
+
+    bool ok = true;
+    for (int edit = 0; edit <= EDITS; edit++) {
+        vector<int> anchors = Anchors(n, stride, edit);
+        for (Mesh *m: {&fixed, &eliminated}) {
+            /* SetConstraints takes the anchor targets from p_prime */
+            for (size_t k = 0; k < anchors.size(); k += 3) {
+                m->p_prime.col(anchors[k]) += Eigen::Vector3d(0.05, 0.02, -0.03);
+            }
+            m->SetConstraints(anchors);
+            m->Deform(3, weight_type);
+        }
+        double difference = (fixed.p_prime - eliminated.p_prime).cwiseAbs().maxCoeff();
+        bool same = fixed.p_prime.allFinite() && difference <= TOLERANCE;
+        cout << (same ? "ok   " : "FAIL ") << anchors.size() << " anchors: max difference " << difference << endl;
+        ok = ok && same;
+    }
+    if (fixed.factorization_counter.factorizations != 1) {
+        cout << "FAIL fixed laplacian ran " << fixed.factorization_counter.factorizations << " factorizations" << endl;
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+#include "rotation.hpp"
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// FastRotations has to fit the same rotations as the JacobiSVD path
+// (SvdRotation) on random covariances and on the degenerate ones that the
+// local step meets on flat or collapsed neighborhoods: near reflections with
+// det(S) < 0, rank 2 (planar one-rings), rank 1 and zero. Where the rotation is
+// unique, R itself is compared; elsewhere the objective tr(R S) and det(R)
+// Usage: ./arap_test_rotations
+
+const double TOLERANCE = 1e-9;
+const int COUNT = 10000;
+
+struct Case {
+    string name;
+    bool unique;                        // the maximizing rotation is unique
+    vector<Eigen::Matrix3d> covariances;
+};
+
+// n matrices from make, called with the generator and the index
+template <class Make>
+vector<Eigen::Matrix3d> Covariances(int n, Make make) {
+    mt19937 generator(1);
+    vector<Eigen::Matrix3d> covariances(n);
+    for (int i = 0; i < n; i++) covariances[i] = make(generator, i);
+    return covariances;
+}
+
+Eigen::Matrix3d Gaussian(mt19937 &generator) {
+    normal_distribution<double> normal;
+    Eigen::Matrix3d S;
+    for (int k = 0; k < 9; k++) S(k) = normal(generator);
+    return S;
+}
+
+Eigen::Matrix3d RandomRotation(mt19937 &generator) {
+    normal_distribution<double> normal;
+    Eigen::Quaterniond q(normal(generator), normal(generator), normal(generator), normal(generator));
+    return q.normalized().toRotationMatrix();
+}
+
+vector<Eigen::Matrix3d> FastRotationsOf(const vector<Eigen::Matrix3d> &covariances) {
+    int n = (int)covariances.size();
+    vector<Eigen::Matrix3d> fast(n);
+    for (int g = 0; g < n; g += ROTATION_LANES) {
+        double S[3][3][ROTATION_LANES], R[3][3][ROTATION_LANES];
+        for (int l = 0; l < ROTATION_LANES; l++)
+            for (int r = 0; r < 3; r++)
+                for (int c = 0; c < 3; c++) S[r][c][l] = covariances[min(g + l, n - 1)](r, c);
+        FastRotations(S, R);
+        for (int l = 0; l < ROTATION_LANES && g + l < n; l++)
+            for (int r = 0; r < 3; r++)
+                for (int c = 0; c < 3; c++) fast[g + l](r, c) = R[r][c][l];
+    }
+    return fast;
+}
+
+bool RunCase(const Case &c) {
+    vector<Eigen::Matrix3d> fast = FastRotationsOf(c.covariances);
+    double deviation = 0, deficit = 0, determinant = 0, orthogonality = 0;
+    for (size_t i = 0; i < c.covariances.size(); i++) {
+        const Eigen::Matrix3d &S = c.covariances[i], &R = fast[i];
+        Eigen::Matrix3d reference = SvdRotation(S);
+        double scale = S.norm() + 1e-300;
+        if (c.unique) deviation = max(deviation, (R - reference).norm());
+        deficit = max(deficit, ((reference * S).trace() - (R * S).trace()) / scale);
+        determinant = max(determinant, abs(R.determinant() - 1));
+        orthogonality = max(orthogonality, (R.transpose() * R - Eigen::Matrix3d::Identity()).norm());
+    }
+    bool ok = deviation <= TOLERANCE && deficit <= TOLERANCE && determinant <= TOLERANCE
+              && orthogonality <= TOLERANCE;
+    cout << (ok ? "ok   " : "FAIL ") << c.name << ": deviation " << deviation << ", objective deficit "
+         << deficit << ", det error " << determinant << ", orthogonality " << orthogonality << endl;
+    return ok;
+}
+
+int main() {
+    vector<Case> cases;
+    cases.push_back({"random", true, Covariances(COUNT, [](mt19937 &g, int) { return Gaussian(g); })});
+    cases.push_back({"near rotations", true, Covariances(COUNT, [](mt19937 &g, int) {
+        return Eigen::Matrix3d(RandomRotation(g) * (Eigen::Matrix3d::Identity() + 0.01 * Gaussian(g)));
+    })});
+    /* a mirrored rotation, det(S) < 0, the fit flips the axis of the smallest singular value */
+    cases.push_back({"near reflections", true, Covariances(COUNT, [](mt19937 &g, int) {
+        Eigen::Matrix3d mirror = Eigen::Vector3d(1, 0.8, -0.5).asDiagonal();
+        return Eigen::Matrix3d(RandomRotation(g) * mirror * (Eigen::Matrix3d::Identity() + 0.01 * Gaussian(g)) * RandomRotation(g));
+    })});
+    cases.push_back({"reflections, equal singular values", false, Covariances(COUNT, [](mt19937 &g, int) {
+        return Eigen::Matrix3d(-RandomRotation(g));
+    })});
+    cases.push_back({"rank 2", true, Covariances(COUNT, [](mt19937 &g, int) {
+        Eigen::Matrix3d flat = Eigen::Vector3d(2, 1, 0).asDiagonal();
+        return Eigen::Matrix3d(RandomRotation(g) * flat * RandomRotation(g));
+    })});
+    cases.push_back({"rank 1", false, Covariances(COUNT, [](mt19937 &g, int) {
+        normal_distribution<double> normal;
+        Eigen::Vector3d u(normal(g), normal(g), normal(g)), v(normal(g), normal(g), normal(g));
+        return Eigen::Matrix3d(u * v.transpose());
+    })});
+    cases.push_back({"zero", false, Covariances(ROTATION_LANES, [](mt19937 &, int) {
+        return Eigen::Matrix3d::Zero().eval();
+    })});
+
+    int failures = 0;
+    for (const Case &c: cases) {
+        if (!RunCase(c)) failures++;
+    }
+    return failures == 0 ? 0 : 1;
+}
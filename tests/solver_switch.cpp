@@ -0,0 +1,83 @@
+#include "mesh.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Switching Mesh::linear_solver between Deform calls has to rebuild the linear
+// system: deforms, switches the solver (and in some cases the anchors), deforms
+// again and compares the result with a mesh that starts from the same
+// positions and builds its system for the second call from scratch
+// Usage: ./arap_test_solver_switch ${Obj_path}
+
+const double TOLERANCE = 1e-6;  // the conjugate gradients stop at a relative residual of 1e-10
+
+struct Case {
+    string name;
+    CONSTRAINT_MODE constraint_mode;
+    LINEAR_SOLVER first, second;
+    bool change_anchors;
+};
+
+vector<int> Anchors(int n, int stride, int offset) {
+    vector<int> anchors;
+    for (int i = offset; i < n; i += stride) anchors.push_back(i);
+    return anchors;
+}
+
+// deforms with the anchors every stride vertices, moving every second one of them
+void DeformWith(Mesh &mesh, const vector<int> &anchors) {
+    for (size_t k = 0; k < anchors.size(); k += 2) {
+        Vertex *v = mesh.Vertices()[anchors[k]];
+        v->SetPosition(v->Position() + Vector3d(0.1, 0.05, 0));
+    }
+    mesh.SetConstraints(anchors);
+    mesh.Deform(5, COTANGENT);
+}
+
+bool RunCase(const char *path, const Case &c) {
+    Mesh mesh, fresh;
+    if (!mesh.LoadObjFile(path) || !fresh.LoadObjFile(path)) {
+        cout << "Cannot load " << path << endl;
+        return false;
+    }
+    int n = (int)mesh.Vertices().size();
+    vector<int> before = Anchors(n, 37, 0), after = c.change_anchors ? Anchors(n, 41, 5) : before;
+
+    mesh.constraint_mode = c.constraint_mode;
+    mesh.linear_solver = c.first;
+    DeformWith(mesh, before);
+
+    mesh.linear_solver = c.second;
+    fresh.constraint_mode = c.constraint_mode;
+    fresh.linear_solver = c.second;
+    fresh.p_prime = mesh.p_prime;
+    DeformWith(mesh, after);
+    DeformWith(fresh, after);
+
+    double difference = (mesh.p_prime - fresh.p_prime).cwiseAbs().maxCoeff();
+    bool ok = difference <= TOLERANCE;
+    cout << (ok ? "ok   " : "FAIL ") << c.name << ": max difference " << difference << endl;
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        cout << "Usage: ./arap_test_solver_switch ${Obj_path}" << endl;
+        return 2;
+    }
+    const Case cases[] = {
+        {"elimination ldlt -> cg", ELIMINATION, LDLT, CONJUGATE_GRADIENT, false},
+        {"elimination cg -> ldlt", ELIMINATION, CONJUGATE_GRADIENT, LDLT, false},
+        {"elimination cg -> ldlt, new anchors", ELIMINATION, CONJUGATE_GRADIENT, LDLT, true},
+        {"fixed laplacian ldlt -> cg", FIXED_LAPLACIAN, LDLT, CONJUGATE_GRADIENT, false},
+        {"fixed laplacian cg -> ldlt", FIXED_LAPLACIAN, CONJUGATE_GRADIENT, LDLT, false},
+        {"fixed laplacian cg -> ldlt, new anchors", FIXED_LAPLACIAN, CONJUGATE_GRADIENT, LDLT, true},
+    };
+    int failures = 0;
+    for (const Case &c: cases) {
+        if (!RunCase(argv[1], c)) failures++;
+    }
+    return failures == 0 ? 0 : 1;
+}